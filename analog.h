@@ -1,9 +1,16 @@
 #include <esp32-hal.h>
 #include <driver/adc.h>
 #include <esp_adc_cal.h>
+#include <vector>
+#include <algorithm>
 
 #define ADC_SAMPLES 16
 
+// ADC_MEDIAN selects the median of the samples instead of their average
+#ifndef ADC_MEDIAN
+#define ADC_MEDIAN 0
+#endif
+
 static esp_adc_cal_characteristics_t *adc_chars = 0;
 
 void analogSetup(int pin) {
@@ -31,15 +38,15 @@ void analogSetup(int pin) {
 uint16_t analogSample(int pin) {
     adc1_channel_t channel = (adc1_channel_t)digitalPinToAnalogChannel(pin);
 
-#if 0
+#if ADC_MEDIAN
     // median
     std::vector<uint16_t> readings (ADC_SAMPLES);
     for (int i=0; i<ADC_SAMPLES; i++) readings[i] = adc1_get_raw(channel);
     std::sort(readings.begin(), readings.end());
     uint32_t adc_reading = readings[ADC_SAMPLES/2];
     uint32_t millivolts = esp_adc_cal_raw_to_voltage(adc_reading, adc_chars);
-    printf("ADC %d -%d/+%d -> %dmV\n", adc_reading, adc_reading-readings[0],
-            readings[ADC_SAMPLES-1]-adc_reading, millivolts);
+    //printf("ADC %d -%d/+%d -> %dmV\n", adc_reading, adc_reading-readings[0],
+    //        readings[ADC_SAMPLES-1]-adc_reading, millivolts);
 #else
     // averaging
     uint32_t adc_reading = 0;
@@ -0,0 +1,63 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// RF captures record raw received frames with their reception metadata so the exact traffic can
+// be replayed through the gateway later, on-device or in the native host build.
+// A capture is a plain concatenation of records, each being a packed little-endian
+// CaptureRecord header followed by len bytes of frame data. The gateway publishes records on
+// <topic>/capture when rfCapture is set and replays records it receives on <topic>/replay, so
+//   mosquitto_sub -N -t rfgw/xxx/capture >file   and   mosquitto_pub -t rfgw/xxx/replay -f file
+// record resp. replay a capture.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+struct __attribute__((packed)) CaptureRecord {
+    uint32_t sec, usec;         // reception timestamp (radio.rxAt)
+    uint8_t rssi;               // raw radio RSSI, -dBm*2
+    uint8_t margin;             // dB above the noise floor
+    int16_t afc;                // in Hz
+    uint8_t len;                // frame length
+    uint8_t data[0];            // frame data
+};
+
+#define CAPTURE_REC_MAX (sizeof(CaptureRecord)+JL_MAX_PKT)
+
+// CaptureSlot holds one record in a fixed-size buffer so it can be passed through an SPSCRing
+struct CaptureSlot {
+    uint8_t buf[CAPTURE_REC_MAX];
+    int size() { return sizeof(CaptureRecord) + ((CaptureRecord *)buf)->len; }
+};
+
+// captureRecord fills a slot with a frame and its metadata
+static inline void captureRecord(CaptureSlot &slot, const uint8_t *data, int len,
+        struct timeval rxAt, uint8_t rssi, uint8_t margin, int16_t afc)
+{
+    CaptureRecord *r = (CaptureRecord *)slot.buf;
+    if (len > JL_MAX_PKT) len = JL_MAX_PKT;
+    r->sec = rxAt.tv_sec;
+    r->usec = rxAt.tv_usec;
+    r->rssi = rssi;
+    r->margin = margin;
+    r->afc = afc;
+    r->len = len;
+    memcpy(r->data, data, len);
+}
+
+// captureNext returns the record at p and advances p past it, or returns NULL at the end of the
+// buffer or if the record is truncated
+static inline const CaptureRecord *captureNext(const uint8_t *&p, const uint8_t *end) {
+    if (end - p < (int)sizeof(CaptureRecord)) return 0;
+    const CaptureRecord *r = (const CaptureRecord *)p;
+    if (r->len > JL_MAX_PKT || end - p < (int)sizeof(CaptureRecord) + r->len) return 0;
+    p += sizeof(CaptureRecord) + r->len;
+    return r;
+}
+
+// captureUs returns the record's timestamp in microseconds
+static inline uint64_t captureUs(const CaptureRecord *r) {
+    return (uint64_t)r->sec*1000000 + r->usec;
+}
@@ -0,0 +1,60 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// CborWriter appends CBOR (RFC 7049) items to a caller-provided buffer without allocating.
+// Only definite-length items are supported. If the buffer overflows all further output is
+// discarded and ok() returns false.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+class CborWriter {
+public:
+    CborWriter(uint8_t *buf, int size) : buf(buf), size(size), len(0), overflow(false) { }
+
+    CborWriter &uint(uint64_t v) { return head(0, v); }
+    CborWriter &sint(int64_t v) { return v < 0 ? head(1, -1-v) : head(0, v); }
+    CborWriter &bytes(const uint8_t *data, int n) { head(2, n); return raw(data, n); }
+    CborWriter &text(const char *s) { int n = strlen(s); head(3, n); return raw((const uint8_t *)s, n); }
+    CborWriter &array(int n) { return head(4, n); }
+    CborWriter &map(int n) { return head(5, n); }
+
+    bool ok() { return !overflow; }
+    int length() { return len; }
+
+private:
+    // head appends the initial byte(s) of an item using the shortest encoding of v
+    CborWriter &head(uint8_t major, uint64_t v) {
+        uint8_t h[9];
+        int n;
+        major <<= 5;
+        if (v < 24) {
+            h[0] = major | v; n = 1;
+        } else if (v < 0x100) {
+            h[0] = major | 24; h[1] = v; n = 2;
+        } else if (v < 0x10000) {
+            h[0] = major | 25; h[1] = v>>8; h[2] = v; n = 3;
+        } else if (v < 0x100000000ULL) {
+            h[0] = major | 26; n = 5;
+            for (int i=0; i<4; i++) h[1+i] = v >> (24-8*i);
+        } else {
+            h[0] = major | 27; n = 9;
+            for (int i=0; i<8; i++) h[1+i] = v >> (56-8*i);
+        }
+        return raw(h, n);
+    }
+
+    CborWriter &raw(const uint8_t *data, int n) {
+        if (len+n > size) { overflow = true; return *this; }
+        memcpy(buf+len, data, n);
+        len += n;
+        return *this;
+    }
+
+    uint8_t *buf;
+    int size;
+    int len;
+    bool overflow;
+};
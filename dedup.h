@@ -0,0 +1,141 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Uplink de-duplication: every gateway that hears a node would publish the packet, so the
+// backend gets a copy per gateway. With de-duplication only the gateway designated by the node
+// registry, the one reporting the best margin for the node, publishes right away and flags the
+// packet in its gossip with a hash of its format and payload. The other gateways hold their copy
+// for up to a timeout: if the designated gateway's report comes in they suppress their copy,
+// else they publish it. A packet is thus never lost because the designated gateway missed it,
+// at worst it's published twice.
+// DedupCache makes these decisions. The items it holds are opaque, e.g. jlPacket pointers.
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+
+#ifndef DEDUP_SLOTS
+#define DEDUP_SLOTS 32 // max packets held, further packets are published right away
+#endif
+
+// dedupHash returns the 16-bit hash identifying a packet from a node, never 0
+static inline uint16_t dedupHash(uint8_t fmt, const uint8_t *data, int len) {
+    uint32_t h = (2166136261u ^ fmt) * 16777619u; // FNV-1a
+    for (int i=0; i<len; i++) h = (h ^ data[i]) * 16777619u;
+    h = (h ^ (h >> 16)) & 0xffff;
+    return h ? h : 1;
+}
+
+template <typename T, int SLOTS>
+class DedupCache {
+public:
+    enum { PUBLISH, SUPPRESS, HOLD };
+    static const int RECENT = 64; // packets published by other gateways that are remembered
+
+    // peerPublished records that another gateway published a packet, it may be called from any
+    // task, typically from the MQTT callback handling gossip
+    void peerPublished(uint32_t node, uint16_t hash) {
+        std::lock_guard<std::mutex> lock(mtx);
+        Recent &r = recent[recentNum++ % RECENT];
+        r.node = node;
+        r.hash = hash;
+        r.at = millis();
+    }
+
+    // add decides what to do with a received packet: PUBLISH it now, SUPPRESS it because another
+    // gateway published it already, or HOLD it for up to timeoutMs, see poll
+    int add(const T &item, uint32_t node, uint16_t hash, bool designated, uint32_t timeoutMs) {
+        if (designated) return PUBLISH;
+        uint32_t now = millis();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (int i=0; i<RECENT && i<(int)recentNum; i++) {
+                Recent &r = recent[i];
+                if (r.node == node && r.hash == hash && now - r.at <= timeoutMs) {
+                    suppressed++;
+                    return SUPPRESS;
+                }
+            }
+        }
+        for (int i=0; i<SLOTS; i++) {
+            Held &h = held[i];
+            if (h.used) continue;
+            h.item = item;
+            h.node = node;
+            h.hash = hash;
+            h.until = now + timeoutMs;
+            h.used = true;
+            h.suppress = false;
+            holds++;
+            numHeld++;
+            return HOLD;
+        }
+        full++;
+        return PUBLISH;
+    }
+
+    // poll returns a held item that is done with: suppress is set if another gateway published
+    // it, else it timed out and is to be published. It returns false if no item is done.
+    bool poll(T &item, bool &suppress) {
+        if (numHeld == 0) return false;
+        // match the packets other gateways published since the last call
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (recentNum - recentSeen > RECENT) recentSeen = recentNum - RECENT;
+            for (; recentSeen != recentNum; recentSeen++) {
+                Recent &r = recent[recentSeen % RECENT];
+                for (int i=0; i<SLOTS; i++) {
+                    Held &h = held[i];
+                    if (h.used && h.node == r.node && h.hash == r.hash) h.suppress = true;
+                }
+            }
+        }
+        uint32_t now = millis();
+        for (int i=0; i<SLOTS; i++) {
+            Held &h = held[i];
+            if (!h.used || (!h.suppress && (int32_t)(now - h.until) < 0)) continue;
+            item = h.item;
+            suppress = h.suppress;
+            h.used = false;
+            numHeld--;
+            if (suppress) suppressed++; else timeouts++;
+            return true;
+        }
+        return false;
+    }
+
+    // nextTimeout returns the millis when the first held item times out, numHeld must be > 0
+    uint32_t nextTimeout() {
+        uint32_t now = millis(), next = now + 0x7fffffff;
+        for (int i=0; i<SLOTS; i++)
+            if (held[i].used && (int32_t)(held[i].until - next) < 0) next = held[i].until;
+        return next;
+    }
+
+    int numHeld = 0;            // items currently held
+    uint32_t holds = 0;         // packets held
+    uint32_t suppressed = 0;    // packets suppressed because another gateway published them
+    uint32_t timeouts = 0;      // held packets published because no other gateway did
+    uint32_t full = 0;          // packets published right away because the cache was full
+
+private:
+    struct Held {
+        T item;
+        uint32_t node;
+        uint32_t until;         // millis when the item times out
+        uint16_t hash;
+        bool used, suppress;
+    };
+    struct Recent {
+        uint32_t node;
+        uint32_t at;            // millis when the report was received
+        uint16_t hash;
+    };
+
+    Held held[SLOTS] = {};
+    Recent recent[RECENT];
+    uint32_t recentNum = 0;     // number of reports recorded, the ring holds the last RECENT
+    uint32_t recentSeen = 0;    // reports matched against the held items by poll
+    std::mutex mtx;
+};
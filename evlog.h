@@ -0,0 +1,212 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Event log: instead of calling printf on the packet path, which blocks for milliseconds at
+// 115200 baud, code logs events with EVLOG(event, args...). An event is a compact binary record
+// holding the event ID, a timestamp, up to EVLOG_MAX_ARGS 32-bit arguments and optionally a few
+// bytes that get hex dumped. Records go into a RAM ring without blocking, if the ring is full
+// the record is dropped and counted. A low-priority task formats the records using the event's
+// printf format and writes them out, see evlogTask in main.cpp.
+// Each event belongs to a subsystem whose log level is set at run-time, events above the level
+// are discarded before any work is done.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// subsystems
+#define EVLOG_RF    0
+#define EVLOG_MQTT  1
+#define EVLOG_QUEUE 2
+#define EVLOG_REG   3
+#define EVLOG_SUBSYS 4
+
+// levels
+#define EVLOG_OFF   0
+#define EVLOG_ERR   1
+#define EVLOG_INFO  2
+#define EVLOG_DEBUG 3
+
+// EVLOG_EVENTS lists the events: ID, subsystem, level and format. Formats may only use
+// conversions that take an int (%d %u %x %c), they are passed all EVLOG_MAX_ARGS arguments,
+// except that a format may end in %s to print the string of evlogSuffix selected by the last
+// argument after the bytes.
+// The bytes logged with an event are appended as hex.
+#define EVLOG_EVENTS(X) \
+    X(EV_RX,         EVLOG_RF,    EVLOG_INFO,  "RF RX %08x [%c%c%c%c%c]{%d} %ddBm %dHz %d:%s") \
+    X(EV_RX_T,       EVLOG_RF,    EVLOG_INFO,  "RF RX %08x [%c%c%c%c%c]{%d} %ddBm %dHz {%ddBm %dHz} %d:%s") \
+    X(EV_RX_GW,      EVLOG_RF,    EVLOG_DEBUG, "RF RX %08x [%c%c%c%c%c]{%d} %ddBm %dHz [Ignoring packet from another GW]") \
+    X(EV_RX_BAD,     EVLOG_RF,    EVLOG_ERR,   "Cannot decode packet:") \
+    X(EV_RX_NOVARINT, EVLOG_RF,   EVLOG_DEBUG, "RF RX %08x: cannot decode varints: %d") \
+    X(EV_POOL_EMPTY, EVLOG_RF,    EVLOG_ERR,   "OOPS: packet pool exhausted, dropping packet") \
+    X(EV_ACK_FAIL,   EVLOG_RF,    EVLOG_ERR,   "OOPS: couldn't send ACK on radio %d") \
+    X(EV_TX,         EVLOG_MQTT,  EVLOG_INFO,  "MQTT TX from %x at %u sent, id=%d len=%d") \
+    X(EV_RETX,       EVLOG_MQTT,  EVLOG_INFO,  "MQTT TX from %x at %u resent, id=%d len=%d") \
+    X(EV_TX_CBOR,    EVLOG_MQTT,  EVLOG_INFO,  "MQTT TX CBOR from %x at %u sent, id=%d len=%d") \
+    X(EV_RETX_CBOR,  EVLOG_MQTT,  EVLOG_INFO,  "MQTT TX CBOR from %x at %u resent, id=%d len=%d") \
+    X(EV_TX_BATCH,   EVLOG_MQTT,  EVLOG_INFO,  "MQTT TX batch of %d packets after %dms, id=%d len=%d/%d") \
+    X(EV_TX_JSON_BIG, EVLOG_MQTT, EVLOG_ERR,   "OOPS: packet JSON too large") \
+    X(EV_TX_CBOR_BIG, EVLOG_MQTT, EVLOG_ERR,   "OOPS: packet CBOR too large") \
+    X(EV_OTA_BAD,    EVLOG_MQTT,  EVLOG_ERR,   "OTA: bad chunk at %u") \
+    X(EV_OTA_SKIP,   EVLOG_MQTT,  EVLOG_INFO,  "OTA: ignoring chunk at %u, expecting %u") \
+    X(EV_REXMIT,     EVLOG_QUEUE, EVLOG_INFO,  "Rexmit from %x at %u") \
+    X(EV_BACKLOG,    EVLOG_QUEUE, EVLOG_INFO,  "Backlog from %x at %u") \
+    X(EV_QUEUE_FULL, EVLOG_QUEUE, EVLOG_ERR,   "pktQueue full: dropping packet from %x at %u") \
+    X(EV_LOG_BAD,    EVLOG_QUEUE, EVLOG_ERR,   "Flash log: cannot decode logged packet, dropping it") \
+    X(EV_NODE_GW,    EVLOG_REG,   EVLOG_DEBUG, "Node %08x reachable via GW %d with %ddB") \
+    X(EV_NODE_EVICT, EVLOG_REG,   EVLOG_ERR,   "OOPS: node table full, node %08x idle for %ums evicted for %08x")
+
+#define EVLOG_ID(id, subsys, level, fmt) id,
+enum { EVLOG_EVENTS(EVLOG_ID) EV_NUM };
+#undef EVLOG_ID
+
+struct EventInfo {
+    uint8_t subsys, level;
+    const char *fmt;
+};
+#define EVLOG_INFO_ENTRY(id, subsys, level, fmt) { subsys, level, fmt },
+static const EventInfo eventInfo[EV_NUM] = { EVLOG_EVENTS(EVLOG_INFO_ENTRY) };
+#undef EVLOG_INFO_ENTRY
+
+#ifndef EVLOG_RING_SIZE
+#define EVLOG_RING_SIZE 4096 // power of 2
+#endif
+#define EVLOG_MAX_ARGS 13
+#define EVLOG_MAX_BYTES 72
+
+// EventRecord is the header of a record in the ring, it is followed by the arguments and bytes
+struct EventRecord {
+    uint16_t event;
+    uint8_t nArgs, nBytes;
+    uint32_t ms;                // millis() when logged
+};
+
+// evlogSuffix lists the strings an event's %s can print, indexed by a combination of flags
+#define EVLOG_ACKED 1
+#define EVLOG_HELD  2
+#define EVLOG_DUP   4
+static const char *const evlogSuffix[] = {
+    "", " --ACKED", " --HELD", " --ACKED --HELD", " --DUP", " --ACKED --DUP" };
+
+// log level of each subsystem, they are DVs defined in main.cpp
+extern uint8_t evlogRf, evlogMqtt, evlogQueue, evlogReg;
+
+// evlogEnabled returns whether an event is to be logged given its subsystem's log level
+static inline bool evlogEnabled(int ev) {
+    uint8_t level;
+    switch (eventInfo[ev].subsys) {
+    case EVLOG_RF:   level = evlogRf; break;
+    case EVLOG_MQTT: level = evlogMqtt; break;
+    case EVLOG_REG:  level = evlogReg; break;
+    default:         level = evlogQueue; break;
+    }
+    return eventInfo[ev].level <= level;
+}
+
+class EventLog {
+    static_assert((EVLOG_RING_SIZE & (EVLOG_RING_SIZE-1)) == 0, "EVLOG_RING_SIZE must be a power of 2");
+public:
+    // write appends a record, it may be called from any task
+    void write(int ev, const uint32_t *args, int nArgs, const uint8_t *bytes, int nBytes) {
+        if (nArgs > EVLOG_MAX_ARGS) nArgs = EVLOG_MAX_ARGS;
+        if (nBytes > EVLOG_MAX_BYTES) nBytes = EVLOG_MAX_BYTES;
+        if (nBytes < 0) nBytes = 0;
+        EventRecord r;
+        r.event = ev;
+        r.nArgs = nArgs;
+        r.nBytes = nBytes;
+        r.ms = millis();
+        uint32_t size = sizeof(r) + nArgs*4 + nBytes;
+        portENTER_CRITICAL(&mux);
+        if (head - tail + size > EVLOG_RING_SIZE) {
+            dropped++;
+            portEXIT_CRITICAL(&mux);
+            return;
+        }
+        copyIn(&r, sizeof(r));
+        copyIn(args, nArgs*4);
+        copyIn(bytes, nBytes);
+        written++;
+        portEXIT_CRITICAL(&mux);
+    }
+
+    // read removes the oldest record, it returns false if the ring is empty. Only one task may
+    // read.
+    bool read(EventRecord &r, uint32_t *args, uint8_t *bytes) {
+        portENTER_CRITICAL(&mux);
+        if (head == tail) {
+            portEXIT_CRITICAL(&mux);
+            return false;
+        }
+        copyOut(&r, sizeof(r));
+        copyOut(args, r.nArgs*4);
+        copyOut(bytes, r.nBytes);
+        portEXIT_CRITICAL(&mux);
+        return true;
+    }
+
+    // format prints a record into buf and returns the length, like snprintf
+    static int format(const EventRecord &r, const uint32_t *args, const uint8_t *bytes,
+            char *buf, int size)
+    {
+        uint32_t a[EVLOG_MAX_ARGS] = { 0 };
+        memcpy(a, args, r.nArgs*4);
+        int len = snprintf(buf, size, "%u.%03u ", r.ms/1000, r.ms%1000);
+        if (r.event >= EV_NUM) return len + snprintf(buf+len, size-len, "? event %d", r.event);
+        // a format ending in %s has the suffix printed after the bytes
+        const char *fmt = eventInfo[r.event].fmt;
+        int fmtLen = strlen(fmt);
+        bool sfx = fmtLen >= 2 && strcmp(fmt+fmtLen-2, "%s") == 0;
+        char head[128];
+        if (sfx && fmtLen-2 < (int)sizeof(head)) {
+            memcpy(head, fmt, fmtLen-2);
+            head[fmtLen-2] = 0;
+            fmt = head;
+        }
+        len += snprintf(buf+len, size-len, fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+                a[8], a[9], a[10], a[11], a[12]);
+        for (int i=0; i<r.nBytes && len < size; i++)
+            len += snprintf(buf+len, size-len, " %02x", bytes[i]);
+        if (sfx && len < size) {
+            uint32_t i = r.nArgs > 0 ? a[r.nArgs-1] : 0;
+            if (i >= sizeof(evlogSuffix)/sizeof(*evlogSuffix)) i = 0;
+            len += snprintf(buf+len, size-len, "%s", evlogSuffix[i]);
+        }
+        return len < size ? len : size-1;
+    }
+
+    uint32_t written = 0;       // records logged
+    uint32_t dropped = 0;       // records dropped because the ring was full
+
+private:
+    void copyIn(const void *src, int n) {
+        const uint8_t *s = (const uint8_t *)src;
+        for (int i=0; i<n; i++) ring[(head+i) & (EVLOG_RING_SIZE-1)] = s[i];
+        head += n;
+    }
+    void copyOut(void *dst, int n) {
+        uint8_t *d = (uint8_t *)dst;
+        for (int i=0; i<n; i++) d[i] = ring[(tail+i) & (EVLOG_RING_SIZE-1)];
+        tail += n;
+    }
+
+    uint8_t ring[EVLOG_RING_SIZE];
+    uint32_t head = 0, tail = 0;  // byte offsets, wrapping
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
+
+extern EventLog evlog;
+
+// evlogWrite converts the arguments of an event to 32 bits and logs it
+template <typename... A>
+static inline void evlogWrite(int ev, const uint8_t *bytes, int nBytes, A... args) {
+    uint32_t a[sizeof...(A)+1] = { (uint32_t)args... };
+    evlog.write(ev, a, sizeof...(A), bytes, nBytes);
+}
+
+// EVLOG logs an event, EVLOG_BYTES logs an event followed by a hex dump of n bytes
+#define EVLOG(ev, ...) do { if (evlogEnabled(ev)) evlogWrite(ev, 0, 0, ##__VA_ARGS__); } while (0)
+#define EVLOG_BYTES(ev, p, n, ...) \
+    do { if (evlogEnabled(ev)) evlogWrite(ev, p, n, ##__VA_ARGS__); } while (0)
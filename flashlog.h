@@ -0,0 +1,239 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// FlashLog is an append-only ring log in a flash partition that stores the packets received
+// while MQTT is disconnected so they can be published once it reconnects.
+// Each record is a LogHeader followed by a CaptureRecord (see capture.h). Records carry a
+// sequence number and a CRC and never straddle a sector. Appended records are buffered in RAM
+// and written in batches to limit flash wear; a power loss loses at most the buffer. When the
+// log is full the oldest sector is erased and its records are dropped. Published records are
+// marked by clearing a bit in their header, which flash allows without erasing, so a reboot
+// resumes where publishing left off. A torn write is detected by its CRC on reboot and the
+// remainder of that sector is skipped.
+// FlashLog is not thread-safe, it is used from loop() only.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <esp_partition.h>
+
+#define LOG_SECTOR 4096
+#define LOG_MAGIC  0xa5
+#define LOG_LIVE   0x01 // LogHeader flag, cleared once the record has been published
+
+#ifndef FLASH_LOG_BUF
+#define FLASH_LOG_BUF 1024 // size of the RAM write buffer, must be <= LOG_SECTOR
+#endif
+
+struct __attribute__((packed)) LogHeader {
+    uint8_t magic;
+    uint8_t flags;              // not covered by the CRC
+    uint8_t len;                // length of the record following the header
+    uint8_t rsvd;
+    uint32_t seq;
+    uint32_t crc;               // CRC32 of seq, len and the record
+};
+
+#define LOG_REC_MAX (sizeof(LogHeader)+255)
+
+// crc32 is the standard CRC-32 (as used by zlib), computed 4 bits at a time
+static inline uint32_t crc32(uint32_t crc, const uint8_t *p, int len) {
+    static const uint32_t tbl[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158,
+        0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4,
+        0xa00ae278, 0xbdbdf21c };
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ tbl[crc & 15];
+        crc = (crc >> 4) ^ tbl[crc & 15];
+    }
+    return ~crc;
+}
+
+class FlashLog {
+public:
+    // begin recovers the log from the partition, it returns false if the partition is unusable
+    bool begin(const esp_partition_t *p, uint32_t maxSize) {
+        part = p;
+        size = (p->size < maxSize ? p->size : maxSize) / LOG_SECTOR * LOG_SECTOR;
+        if (size < 3*LOG_SECTOR) return false;
+        bufLen = 0;
+        pending = 0;
+        // find the sector holding the newest records
+        int headSec = -1;
+        uint32_t headSeq = 0;
+        for (uint32_t s=0; s<size; s+=LOG_SECTOR) {
+            LogHeader h;
+            if (readRecord(s, h, 0) && (headSec < 0 || (int32_t)(h.seq - headSeq) > 0)) {
+                headSec = s;
+                headSeq = h.seq;
+            }
+        }
+        if (headSec < 0) {
+            // empty log
+            head = tail = 0;
+            nextSeq = 1;
+        } else {
+            // scan all sectors starting with the oldest one to count unpublished records
+            bool first = true;
+            for (uint32_t s = nextSector(headSec); ; s = nextSector(s)) {
+                uint32_t off = s;
+                LogHeader h;
+                while (off + sizeof(LogHeader) <= s + LOG_SECTOR && readRecord(off, h, 0)) {
+                    if (first) { tail = off; first = false; }
+                    if (h.flags & LOG_LIVE) pending++;
+                    nextSeq = h.seq + 1;
+                    off += sizeof(LogHeader) + h.len;
+                }
+                if (s == (uint32_t)headSec) {
+                    // continue after the last good record unless the rest of the sector is dirty
+                    head = off;
+                    if (!erased(off, s + LOG_SECTOR)) {
+                        corrupt++;
+                        head = nextSector(s);
+                    }
+                    break;
+                }
+            }
+        }
+        if (head % LOG_SECTOR == 0 && !erased(head, head + LOG_SECTOR))
+            esp_partition_erase_range(part, head, LOG_SECTOR);
+        startSector();
+        return true;
+    }
+
+    // append adds a record to the write buffer, flushing the buffer as needed
+    void append(const uint8_t *rec, int len) {
+        if (len > 255) return;
+        int n = sizeof(LogHeader) + len;
+        if (bufLen + n > FLASH_LOG_BUF || (head + bufLen) / LOG_SECTOR != (head + bufLen + n - 1) / LOG_SECTOR)
+            flush();
+        if (head % LOG_SECTOR != 0 && head / LOG_SECTOR != (head + n - 1) / LOG_SECTOR)
+            head = nextSector(head); // the record doesn't fit into the current sector
+        if (head / LOG_SECTOR != curSector) startSector();
+        LogHeader h;
+        h.magic = LOG_MAGIC;
+        h.flags = 0xff;
+        h.len = len;
+        h.rsvd = 0xff;
+        h.seq = nextSeq++;
+        h.crc = crc32(crc32(0, (uint8_t *)&h.seq, 4), &h.len, 1);
+        h.crc = crc32(h.crc, rec, len);
+        memcpy(buf+bufLen, &h, sizeof(h));
+        memcpy(buf+bufLen+sizeof(h), rec, len);
+        if (bufLen == 0) bufAt = millis();
+        bufLen += n;
+        pending++;
+        appended++;
+    }
+
+    // flush writes the buffered records to flash
+    void flush() {
+        if (bufLen == 0) return;
+        esp_partition_write(part, head, buf, bufLen);
+        head += bufLen;
+        if (head == size) head = 0;
+        bufLen = 0;
+        writes++;
+    }
+
+    // next returns the oldest unpublished record in rec and its length, or 0 if there is none.
+    // Buffered records are only returned once they have been flushed.
+    int next(uint8_t *rec, int size) {
+        while (tail != head) {
+            LogHeader h;
+            if (tail % LOG_SECTOR + sizeof(LogHeader) > LOG_SECTOR ||
+                    !readRecord(tail, h, rec, size)) {
+                // end of the data in this sector
+                tail = nextSector(tail);
+                continue;
+            }
+            if (!(h.flags & LOG_LIVE)) {
+                tail += sizeof(LogHeader) + h.len;
+                continue;
+            }
+            return h.len;
+        }
+        return 0;
+    }
+
+    // consume marks the record returned by next() as published
+    void consume() {
+        LogHeader h;
+        if (tail == head || esp_partition_read(part, tail, &h, sizeof(h)) != ESP_OK) return;
+        uint8_t flags = h.flags & ~LOG_LIVE;
+        esp_partition_write(part, tail + offsetof(LogHeader, flags), &flags, 1);
+        tail += sizeof(LogHeader) + h.len;
+        pending--;
+        replayed++;
+    }
+
+    uint32_t bufferedAt() { return bufLen ? bufAt : 0; }
+
+    uint32_t pending = 0;       // records not yet published
+    uint32_t appended = 0, replayed = 0;
+    uint32_t dropped = 0;       // unpublished records erased to make room
+    uint32_t corrupt = 0;       // sectors with a torn or corrupt record found by begin()
+    uint32_t writes = 0;        // buffer flushes
+
+private:
+    uint32_t nextSector(uint32_t off) {
+        off = (off / LOG_SECTOR + 1) * LOG_SECTOR;
+        return off >= size ? 0 : off;
+    }
+
+    // startSector is called when head enters a new sector, which is already erased. It erases the
+    // following sector so head never catches up with tail, dropping the oldest records if the
+    // log is full. Thus tail == head means that the log is empty.
+    void startSector() {
+        curSector = head / LOG_SECTOR;
+        uint32_t s = nextSector(head);
+        if (tail != head && tail / LOG_SECTOR == s / LOG_SECTOR) {
+            for (uint32_t off = tail; off + sizeof(LogHeader) <= s + LOG_SECTOR; ) {
+                LogHeader h;
+                if (!readRecord(off, h, 0)) break;
+                if (h.flags & LOG_LIVE) { pending--; dropped++; }
+                off += sizeof(LogHeader) + h.len;
+            }
+            tail = nextSector(s);
+        }
+        if (!erased(s, s + LOG_SECTOR)) esp_partition_erase_range(part, s, LOG_SECTOR);
+    }
+
+    // readRecord reads and checks the record at off, copying its data to rec if not NULL
+    bool readRecord(uint32_t off, LogHeader &h, uint8_t *rec, int recSize = 0) {
+        if (esp_partition_read(part, off, &h, sizeof(h)) != ESP_OK) return false;
+        if (h.magic != LOG_MAGIC || off % LOG_SECTOR + sizeof(h) + h.len > LOG_SECTOR)
+            return false;
+        uint8_t tmp[255];
+        uint8_t *d = rec && recSize >= h.len ? rec : tmp;
+        if (esp_partition_read(part, off+sizeof(h), d, h.len) != ESP_OK) return false;
+        uint32_t crc = crc32(crc32(0, (uint8_t *)&h.seq, 4), &h.len, 1);
+        return crc32(crc, d, h.len) == h.crc;
+    }
+
+    // erased returns whether the range is all 0xff
+    bool erased(uint32_t from, uint32_t to) {
+        uint8_t b[64];
+        while (from < to) {
+            int n = to - from < sizeof(b) ? to - from : sizeof(b);
+            esp_partition_read(part, from, b, n);
+            for (int i=0; i<n; i++) if (b[i] != 0xff) return false;
+            from += n;
+        }
+        return true;
+    }
+
+    const esp_partition_t *part;
+    uint32_t size;              // bytes of the partition used
+    uint32_t head;              // offset where the write buffer goes
+    uint32_t tail;              // offset of the oldest record that may be unpublished
+    uint32_t nextSeq;
+    uint32_t curSector;         // sector head is in, used to detect when head enters a new one
+    uint8_t buf[FLASH_LOG_BUF];
+    int bufLen;
+    uint32_t bufAt;             // millis when the first buffered record was appended
+};
@@ -5,15 +5,21 @@
 #include <SPI.h>
 #include <SX1276fsk.h>
 #include "formats.h"
+#include "jsonwriter.h"
+#include "cborwriter.h"
+#include "varint.h"
+
+PacketPool pktPool;
 
 jlPacket *processJLv1Pkt(uint8_t *buf, int len) {
     //printf("processJLv1Pkt, len=%d\n", len);
-    if (len < 5) return 0;
+    if (len < 5 || len > JL_MAX_PKT) return 0;
     bool trailer = (buf[2] >> 7) & 1;
     //if (trailer && len < 9) return 0;
     uint8_t payLen = len - 3; // peel off hdr,src,fmt bytes
     if (trailer) payLen -= 2;
-    jlPacket *pkt = (jlPacket *)calloc((sizeof(jlPacket)+payLen+3)/4, 4);
+    jlPacket *pkt = pktPool.alloc();
+    if (!pkt) return 0;
     bool fromGW = (buf[0]&0x3f) != 0;
     pkt->vers = 0; // 0->v1
     pkt->fromGW  = fromGW;
@@ -35,12 +41,13 @@ jlPacket *processJLv1Pkt(uint8_t *buf, int len) {
 }
 
 jlPacket *processJLv2Pkt(uint8_t *buf, int len) {
-    if (len < 6) return 0;
+    if (len < 6 || len > JL_MAX_PKT) return 0;
     bool trailer = (buf[5] >> 7) & 1;
     if (trailer && len < 8) return 0;
     uint8_t dataLen = len - 6;
     if (trailer) dataLen -= 2;
-    jlPacket *pkt = (jlPacket *)calloc((sizeof(jlPacket)+dataLen+3)/4, 4);
+    jlPacket *pkt = pktPool.alloc();
+    if (!pkt) return 0;
     pkt->vers = 1; // 1->v2
     pkt->special = (buf[0] >> 6) & 1;
     pkt->fromGW  = (buf[0] >> 5) & 1;
@@ -57,12 +64,29 @@ jlPacket *processJLv2Pkt(uint8_t *buf, int len) {
     return pkt;
 }
 
+// isJLv1 is the heuristic to disambiguate old JL vs new JL formats, len must be >= 2
+static inline bool isJLv1(const uint8_t *buf) {
+    return ((buf[0]&0x3f) == 0 && (buf[1]&0x3f) == 61) ||
+        ((buf[1]&0x3f) == 0 && (buf[0]&0x3f) == 61);
+}
+
+int jlAckRequest(const uint8_t *buf, int len, uint32_t *node) {
+    if (len < 2 || len > JL_MAX_PKT) return 0;
+    if (isJLv1(buf)) {
+        bool fromGW = (buf[0]&0x3f) != 0;
+        if (fromGW || len < 7 || !(buf[1] & 0x80)) return 0;
+        decodeVarint((uint8_t *)buf+3, 5, (int32_t*)node);
+        return 1;
+    }
+    if (len < 6 || (buf[0] & 0x70) != 0x10) return 0; // data, to-GW, ack-req
+    memcpy(node, buf+1, 4);
+    return 2;
+}
+
 jlPacket *processRFPacket(uint8_t *buf, int length, struct timeval rxAt, int8_t rssi, uint8_t snr, int16_t fei) {
     if (length < 2) return NULL;
-    // heuristic to disambiguate old JL vs new JL formats
     jlPacket *pkt;
-    if (((buf[0]&0x3f) == 0 && (buf[1]&0x3f) == 61) ||
-        ((buf[1]&0x3f) == 0 && (buf[0]&0x3f) == 61)) {
+    if (isJLv1(buf)) {
             pkt = processJLv1Pkt(buf, length);
     } else {
             pkt = processJLv2Pkt(buf, length);
@@ -77,3 +101,70 @@ jlPacket *processRFPacket(uint8_t *buf, int length, struct timeval rxAt, int8_t
     return pkt;
 }
 
+int encodeRxJson(jlPacket *pkt, const char *gw, char *buf, int size) {
+    // the date and time down to the second only changes once per second, cache it
+    static time_t dateSec = -1;
+    static char date[24]; // "YYYY-MM-DDTHH:MM:SS."
+    static int dateLen = 0;
+    if (pkt->at.tv_sec != dateSec) {
+        struct tm tm;
+        gmtime_r(&pkt->at.tv_sec, &tm);
+        JsonWriter d(date, sizeof(date));
+        d.u32(tm.tm_year+1900).chr('-').u32(tm.tm_mon+1, 2).chr('-').u32(tm.tm_mday, 2)
+            .chr('T').u32(tm.tm_hour, 2).chr(':').u32(tm.tm_min, 2).chr(':').u32(tm.tm_sec, 2)
+            .chr('.');
+        dateLen = d.length();
+        dateSec = pkt->at.tv_sec;
+    }
+
+    // json-encode all the metadata
+    JsonWriter w(buf, size);
+    w.raw("{\"at\":\"").raw(date, dateLen).u32(pkt->at.tv_usec/1000, 3).raw("Z\",\"gw\":\"").raw(gw)
+        .raw("\",\"hwid\":\"").hex(pkt->node)
+        .raw("\",\"rssi\":").i32(pkt->rssi)
+        .raw(",\"snr\":").u32(pkt->snr)
+        .raw(",\"fei\":").i32(pkt->fei)
+        .raw(",\"type\":").u32(pkt->fmt)
+        .raw(",\"remote_margin\":").u32(pkt->remMargin)
+        .raw(",\"remote_fei\":").i32(pkt->remFEI)
+        .raw(",\"payload\":\"");
+    if (pkt->dataLen > 0) {
+        // add the payload as a base64 encoded string
+        w.base64(pkt->data, pkt->dataLen).chr('"');
+        // add the varint-decoded payload as data array
+        int c = varintCount(pkt->data, pkt->dataLen);
+        // payloads that aren't varints are logged by rxLoop as EV_RX_NOVARINT
+        if (c > 0) {
+            w.raw(",\"data\":[");
+            VarintReader r(pkt->data, pkt->dataLen);
+            int32_t v;
+            for (int i=0; r.next(v); i++) w.i32(v).chr(i==c-1 ? ']' : ',');
+        }
+    }
+    w.chr('}');
+    return w.ok() ? w.length() : -1;
+}
+
+int encodeRxCbor(jlPacket *pkt, const char *gw, uint8_t *buf, int size) {
+    int c = varintCount(pkt->data, pkt->dataLen);
+
+    CborWriter w(buf, size);
+    w.map(c > 0 ? 11 : 10);
+    w.uint(0).uint((uint64_t)pkt->at.tv_sec*1000 + pkt->at.tv_usec/1000);
+    w.uint(1).text(gw);
+    w.uint(2).uint(pkt->node);
+    w.uint(3).sint(pkt->rssi);
+    w.uint(4).uint(pkt->snr);
+    w.uint(5).sint(pkt->fei);
+    w.uint(6).uint(pkt->fmt);
+    w.uint(7).uint(pkt->remMargin);
+    w.uint(8).sint(pkt->remFEI);
+    w.uint(9).bytes(pkt->data, pkt->dataLen);
+    if (c > 0) {
+        w.uint(10).array(c);
+        VarintReader r(pkt->data, pkt->dataLen);
+        int32_t v;
+        while (r.next(v)) w.sint(v);
+    }
+    return w.ok() ? w.length() : -1;
+}
@@ -34,9 +34,13 @@
 //   c=1, a=0 : ack.
 //   c=1, a=1 : unused.
 
+#include "timing.h"
+
 // jlPacket contains a partially decoded JeeLabs v1 or v2 packet
 struct jlPacket {
     bool        isAck:1, fromGW:1, ackReq:1, special:1, trailer:1, vers:2;
+    bool        acked:1;        // gateway sent an ACK
+    bool        logged:1;       // stored in the flash log for publishing once MQTT is connected
     uint8_t     fmt;            // 0..127
     int16_t     remFEI;         // in Hz
     uint8_t     remMargin;      // in dB
@@ -47,10 +51,47 @@ struct jlPacket {
     struct timeval at;          // arrival timestamp
     uint32_t    mqAt;           // timestamp of last mqtt transmission
     uint32_t    node;           // 32-bit node id
+#if PKT_TIMING
+    uint32_t    ts[PKT_STAGES]; // stage timestamps, see timing.h
+#endif
     uint8_t     data[0];        // actual length is dataLen
 };
 
+// JL_MAX_PKT is the max length of a raw RF packet, it sizes the RX buffer and the packet pool slots
+#define JL_MAX_PKT 70
+
+// pktPool holds all jlPacket structs, each slot has room for the largest possible payload
+#ifndef PKT_POOL_SIZE
+#define PKT_POOL_SIZE 128
+#endif
+#include "pool.h"
+typedef SlabPool<jlPacket, sizeof(jlPacket)+JL_MAX_PKT, PKT_POOL_SIZE> PacketPool;
+extern PacketPool pktPool;
+
 jlPacket *processJLv1Pkt(uint8_t *buf, int len);
 jlPacket *processJLv2Pkt(uint8_t *buf, int len);
 jlPacket *processRFPacket(uint8_t *buf, int length, struct timeval rxAt, int8_t rssi,
         uint8_t snr, int16_t fei);
+
+// jlAckRequest checks without decoding the packet whether it is a data packet from a node that
+// requests an ACK. If so it sets node and returns the format version, 1 or 2, else it returns 0.
+int jlAckRequest(const uint8_t *buf, int len, uint32_t *node);
+
+// RX_JSON_MAX is the buffer size needed for the largest <topic>/rx JSON message
+#define RX_JSON_MAX 640
+
+// encodeRxJson formats a packet as JSON for the <topic>/rx MQTT message, gw is the gateway name.
+// It returns the length or -1 if the buffer is too small. It is not reentrant.
+int encodeRxJson(jlPacket *pkt, const char *gw, char *buf, int size);
+
+// RX_CBOR_MAX is the buffer size needed for the largest <topic>/rxb CBOR message
+#define RX_CBOR_MAX 320
+
+// encodeRxCbor encodes the same fields as encodeRxJson as a CBOR map with small integer keys
+// for the <topic>/rxb MQTT message, see rxcbor.py for a reference decoder:
+//   0: at (uint, ms since epoch)   4: snr (uint)       8: remote_fei (int)
+//   1: gw (text)                   5: fei (int)        9: payload (bytes)
+//   2: hwid (uint, node id)        6: type (uint)     10: data (array of int, optional)
+//   3: rssi (int)                  7: remote_margin (uint)
+// It returns the length or -1 if the buffer is too small.
+int encodeRxCbor(jlPacket *pkt, const char *gw, uint8_t *buf, int size);
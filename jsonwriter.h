@@ -0,0 +1,114 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// JsonWriter appends JSON fragments to a caller-provided buffer in a single pass without
+// allocating and without going through printf. It does not check JSON syntax, it just provides
+// fast formatting of the pieces. If the buffer overflows all further output is discarded and
+// ok() returns false.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// digits2 holds the two-digit representation of 00..99 to format two digits at a time
+static const char digits2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+class JsonWriter {
+public:
+    JsonWriter(char *buf, int size) : buf(buf), size(size), len(0), overflow(false) { }
+
+    // raw appends n characters as-is
+    JsonWriter &raw(const char *s, int n) {
+        if (len+n > size) { overflow = true; return *this; }
+        memcpy(buf+len, s, n);
+        len += n;
+        return *this;
+    }
+    JsonWriter &raw(const char *s) { return raw(s, strlen(s)); }
+
+    JsonWriter &chr(char c) {
+        if (len >= size) { overflow = true; return *this; }
+        buf[len++] = c;
+        return *this;
+    }
+
+    // u32 appends an unsigned decimal integer, zero-padded to at least minDigits
+    JsonWriter &u32(uint32_t v, int minDigits = 1) {
+        char tmp[10];
+        char *p = tmp+sizeof(tmp);
+        while (v >= 100) {
+            uint32_t q = v / 100;
+            p -= 2;
+            memcpy(p, digits2 + 2*(v - q*100), 2);
+            v = q;
+        }
+        if (v >= 10) {
+            p -= 2;
+            memcpy(p, digits2 + 2*v, 2);
+        } else {
+            *--p = '0' + v;
+        }
+        while (tmp+sizeof(tmp)-p < minDigits) *--p = '0';
+        return raw(p, tmp+sizeof(tmp)-p);
+    }
+
+    // i32 appends a signed decimal integer
+    JsonWriter &i32(int32_t v) {
+        if (v < 0) {
+            chr('-');
+            return u32(-(uint32_t)v);
+        }
+        return u32(v);
+    }
+
+    // hex appends an unsigned integer in lower-case hex without leading zeroes
+    JsonWriter &hex(uint32_t v) {
+        char tmp[8];
+        char *p = tmp+sizeof(tmp);
+        do {
+            *--p = "0123456789abcdef"[v & 0xf];
+            v >>= 4;
+        } while (v);
+        return raw(p, tmp+sizeof(tmp)-p);
+    }
+
+    // base64 appends binary data as padded base64
+    JsonWriter &base64(const uint8_t *data, int n) {
+        static const char tbl[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        int outLen = (n+2)/3*4;
+        if (len+outLen > size) { overflow = true; return *this; }
+        char *o = buf+len;
+        int i = 0;
+        for (; i+2 < n; i += 3) {
+            uint32_t v = (data[i]<<16) | (data[i+1]<<8) | data[i+2];
+            *o++ = tbl[(v>>18)&63];
+            *o++ = tbl[(v>>12)&63];
+            *o++ = tbl[(v>>6)&63];
+            *o++ = tbl[v&63];
+        }
+        if (i < n) {
+            uint32_t v = data[i]<<16;
+            if (i+1 < n) v |= data[i+1]<<8;
+            *o++ = tbl[(v>>18)&63];
+            *o++ = tbl[(v>>12)&63];
+            *o++ = i+1 < n ? tbl[(v>>6)&63] : '=';
+            *o++ = '=';
+        }
+        len += outLen;
+        return *this;
+    }
+
+    bool ok() { return !overflow; }
+    int length() { return len; }
+
+private:
+    char *buf;
+    int size;
+    int len;
+    bool overflow;
+};
@@ -8,11 +8,25 @@
 #include <SX1276fsk.h>
 #include <WiFi.h>
 #include <ESPSecureBase.h>
-#include <libb64/cencode.h>
+#include <ESPAsyncWebServer.h>
 #include <lwip/apps/sntp.h>
+#include <esp_ota_ops.h>
+#include <stdarg.h>
 #include "formats.h"
 #include "registry.h"
 #include "analog.h"
+#include "ring.h"
+#include "pktqueue.h"
+#include "capture.h"
+#include "histogram.h"
+#include "flashlog.h"
+#include "dedup.h"
+#include "evlog.h"
+#include "radio.h"
+#include "metrics.h"
+#include "memacct.h"
+#include "ota.h"
+#include "varint.h"
 
 //===== I/O pins/devices
 
@@ -69,13 +83,45 @@
 #define LED_ON      0
 #define LED_OFF     1
 
+#elif defined BOARD_NATIVE
+
+// host build against the fake radio and MQTT client in native/
+#define RF_SS      -1
+#define RF_RESET   -1
+#define RF_CLK     -1
+#define RF_MISO    -1
+#define RF_MOSI    -1
+#define RF_DIO0    -1
+#define RF_DIO4    -1
+// up to four fake radios on adjacent channels, the native driver sets rfNum
+#define RF_RADIOS { \
+    { -1, -1, -1, -1, 0, 0 }, { -1, -1, -1, -1, 912700000, 0 }, \
+    { -1, -1, -1, -1, 912900000, 0 }, { -1, -1, -1, -1, 913100000, 0 } }
+
+#define LED_RF     -1
+#define LED_MQTT   -1
+#define LED_WIFI   -1
+#define LED_ON      1
+#define LED_OFF     0
+
+#define VBATT      35 // reads the fake ADC, see native/driver/adc.h
+
 #else
 
 #error "Board is not defined"
 #endif
 
 SPIClass spi;
-SX1276fsk radio(spi, RF_SS, RF_RESET); // ss and reset pins
+
+// RF_RADIOS lists the radios on the SPI bus: ss, reset, dio0 and dio4 pins, frequency and group,
+// see radio.h. A board with several radios defines it above.
+#ifndef RF_RADIOS
+#define RF_RADIOS { { RF_SS, RF_RESET, RF_DIO0, RF_DIO4, 0, 0 } }
+#endif
+static const RadioConfig rfConfig[] = RF_RADIOS;
+#define RF_MAX_RADIOS (sizeof(rfConfig)/sizeof(*rfConfig))
+Radio radios[RF_MAX_RADIOS];
+int rfNum = RF_MAX_RADIOS; // number of radios in use
 
 uint8_t rfId        = 63; // 61=tx-only node, 63=promisc node
 uint8_t rfGroup     = 6;
@@ -85,7 +131,7 @@ DV(rfId); DV(rfGroup); DV(rfFreq); DV(rfPow);
 
 uint32_t rfLed = 0;
 uint32_t mqttLed = 0;
-uint32_t vBatt = 1;
+uint32_t vBatt = 1; // mV, written by vBattTask, a 32-bit word can be read without a lock
 
 ESBConfig config;
 CommandParser cmdP(&Serial);
@@ -97,223 +143,1143 @@ bool mqttConn = false; // whether mqtt is connected or not
 DV(mqttConn);
 
 NodeRegistryWorker nrw(mqTopic, GW_TOPIC);
+uint8_t gossipBinary = 0;   // 1: send binary summaries to other GWs instead of JSON per packet
+uint32_t gossipMs = 100;    // max delay of a reception in a binary summary
+uint8_t ackMode = ACK_REGISTRY; // ACK_ARBITRATE: decide locally based on peers' margins
+DV(gossipBinary); DV(gossipMs); DV(ackMode);
+
+//===== Memory accounting, see memacct.h
+
+MemAcct memAcct;
+thread_local uint8_t memTag = MEM_OTHER;
+bool memTagReady = false;
+
+#if MEMACCT
+// memAlloc and memFree implement the global operator new and delete, charging each allocation
+// to the running task's memTag
+void *memAlloc(size_t size) {
+    MemHdr *h = (MemHdr *)malloc(sizeof(MemHdr) + size);
+    if (!h) return 0;
+    h->size = size;
+    h->tag = memTagReady ? memTag : (uint8_t)MEM_OTHER;
+    memAcct.alloc(h->tag, size);
+    return h+1;
+}
+
+void memFree(void *p) {
+    if (!p) return;
+    MemHdr *h = (MemHdr *)p - 1;
+    memAcct.free(h->tag, h->size);
+    free(h);
+}
+
+// out of memory aborts, like operator new does when exceptions are disabled
+void *operator new(size_t size) {
+    void *p = memAlloc(size);
+    if (!p) abort();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return memAlloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return memAlloc(size); }
+void operator delete(void *p) noexcept { memFree(p); }
+void operator delete[](void *p) noexcept { memFree(p); }
+void operator delete(void *p, size_t) noexcept { memFree(p); }
+void operator delete[](void *p, size_t) noexcept { memFree(p); }
+#endif
+
+//===== Event log, see evlog.h
+
+// log level of each subsystem: EVLOG_OFF, EVLOG_ERR, EVLOG_INFO or EVLOG_DEBUG
+uint8_t evlogRf = EVLOG_INFO, evlogMqtt = EVLOG_INFO, evlogQueue = EVLOG_INFO, evlogReg = EVLOG_ERR;
+uint8_t evlogMqttOut = 0; // 1: also publish the log on <topic>/log
+DV(evlogRf); DV(evlogMqtt); DV(evlogQueue); DV(evlogReg); DV(evlogMqttOut);
+EventLog evlog;
+
+#ifndef EVLOG_TASK_PRIO
+#define EVLOG_TASK_PRIO 1
+#endif
+#define EVLOG_TASK_MS 20 // interval at which the log task drains the ring
+#define EVLOG_MQTT_MAX 1024 // max size of a <topic>/log message
+
+// evlogPublish publishes a batch of log lines, QoS 0 as it's best effort anyway
+void evlogPublish(const char *msg, int len) {
+    char topic[41+6];
+    strcpy(topic, mqTopic);
+    strcat(topic, "/log");
+    mqttClient.publish(topic, 0, false, msg, len, false);
+}
+
+// evlogTask formats the logged events and prints them, it runs at low priority so the serial
+// port never delays the packet path. Lines are batched into <topic>/log messages if enabled.
+void evlogTask(void *arg) {
+    memTag = MEM_LOG;
+    static char msg[EVLOG_MQTT_MAX];
+    EventRecord r;
+    uint32_t args[EVLOG_MAX_ARGS];
+    uint8_t bytes[EVLOG_MAX_BYTES];
+    char line[320];
+    while (true) {
+        int msgLen = 0;
+        while (evlog.read(r, args, bytes)) {
+            int len = EventLog::format(r, args, bytes, line, sizeof(line));
+            printf("%s\n", line);
+            if (!evlogMqttOut || !mqttConn) continue;
+            if (msgLen + len + 1 > EVLOG_MQTT_MAX) {
+                evlogPublish(msg, msgLen);
+                msgLen = 0;
+            }
+            memcpy(msg+msgLen, line, len);
+            msgLen += len;
+            msg[msgLen++] = '\n';
+        }
+        if (msgLen > 0) evlogPublish(msg, msgLen);
+        vTaskDelay(EVLOG_TASK_MS / portTICK_PERIOD_MS);
+    }
+}
+
+//===== Loop scheduling
+
+// loop() sleeps until an event wakes it or the earliest deadline of its periodic work is due.
+// Events are packets handed over by the radio task, PUBACKs, MQTT connections and gossip, the
+// deadlines are reported by the code running in loop() using loopNext. loopSleepMs bounds the
+// sleep for what can't wake loop(), i.e. the CLI and Wifi/MQTT disconnections.
+uint32_t loopSleepMs = 100;
+DV(loopSleepMs);
+TaskHandle_t loopTask = 0;
+uint32_t loopDue;                    // millis when loop() needs to run again
+volatile uint32_t loopWokenAt = 0;   // esp_timer_get_time() of the first pending wake-up, or 0
+LogHistogram wakeLatency;            // loopWake -> loop() running, in us
+uint64_t loopIdleUs = 0;             // time spent sleeping
+
+// loopWake wakes loop() up, it may be called from any task
+void loopWake() {
+    if (loopWokenAt == 0) loopWokenAt = esp_timer_get_time() | 1;
+    if (loopTask) xTaskNotifyGive(loopTask);
+}
+
+// loopNext requests that loop() runs again by the given time (millis)
+void loopNext(uint32_t at) {
+    if ((int32_t)(at - loopDue) < 0) loopDue = at;
+}
+
+// loopSleep waits for a wake-up or the earliest deadline
+void loopSleep() {
+    int32_t ms = loopDue - millis();
+    if (ms > 0) {
+        uint64_t t0 = esp_timer_get_time();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms));
+        loopIdleUs += esp_timer_get_time() - t0;
+    }
+    uint32_t w = loopWokenAt;
+    if (w) {
+        loopWokenAt = 0;
+        wakeLatency.record((uint32_t)esp_timer_get_time() - w);
+    }
+    loopDue = millis() + loopSleepMs;
+}
 
 // MQTT message handling
 
 uint32_t mqttTxNum = 0, mqttRxNum = 0;
 
+void onReplayMessage(const char *payload, size_t len, size_t index, size_t total);
+void otaMessage(const char *payload, size_t len, size_t index, size_t total);
+void otaStatus();
+
 void onMqttMessage(char* topic, char* payload, MqttProps properties,
     size_t len, size_t index, size_t total)
 {
+    MemScope mem(MEM_MQTT);
     mqttRxNum++;
 
     // Handle over-the-air update messages
-    if (strlen(topic) == mqTopicLen+4 && len == total &&
+    if (strlen(topic) == (size_t)mqTopicLen+4 && len == total &&
             strncmp(topic, mqTopic, mqTopicLen) == 0 &&
             strcmp(topic+mqTopicLen, "/ota") == 0)
     {
         ESBOTA::begin(payload, len);
     }
 
+    // Handle streaming over-the-air update chunks, see ota.h
+    if (strlen(topic) == (size_t)mqTopicLen+10 && strncmp(topic, mqTopic, mqTopicLen) == 0 &&
+            strcmp(topic+mqTopicLen, "/ota/chunk") == 0)
+    {
+        otaMessage(payload, len, index, total);
+    }
+
+    // Handle RF capture replay messages
+    if (strlen(topic) == (size_t)mqTopicLen+7 && strncmp(topic, mqTopic, mqTopicLen) == 0 &&
+            strcmp(topic+mqTopicLen, "/replay") == 0)
+    {
+        onReplayMessage(payload, len, index, total);
+    }
+
     digitalWrite(LED_WIFI, LED_ON);
     mqttLed = millis();
 }
 
 void onMqttConnect(bool sessionPresent) {
+    MemScope mem(MEM_MQTT);
     printf("Connected to MQTT, session %spresent\n", sessionPresent?"":"not ");
+    loopWake();
     char topic[128];
 
     strncpy(topic, mqTopic, 32);
     strcat(topic, "/ota");
     mqttClient.subscribe(topic, 1);
     printf("Subscribed to %s for OTA\n", topic);
+
+    strncpy(topic, mqTopic, 32);
+    strcat(topic, "/ota/chunk");
+    mqttClient.subscribe(topic, 1);
+    printf("Subscribed to %s for streaming OTA\n", topic);
+    otaStatus();
+
+    strncpy(topic, mqTopic, 32);
+    strcat(topic, "/replay");
+    mqttClient.subscribe(topic, 1);
+    printf("Subscribed to %s for RF replay\n", topic);
 }
 
-// pktBuffer holds packets until they're acknowleged or we give up
-static std::map<uint16_t, jlPacket*> pktBuffer;
+// pktQueue holds packets until they're acknowleged or we give up, it is accessed from loop()
+// and from the MQTT publish callback
+static PacketQueue pktQueue;
+static portMUX_TYPE pktQueueMux = portMUX_INITIALIZER_UNLOCKED;
+#define REXMIT_MS 1100 // retransmit packets not acknowledged by the broker after this time
 
-// sendPacket forwards a packet to the MQTT broker
-void sendPacket(jlPacket *pkt, bool rexmit) {
-    char buf[512];
-    // rxAt is rx time in milliseconds since epoch (javascript timestamp)
-    //uint64_t rxAt = (uint64_t)(pkt->at.tv_sec)*1000 + (uint64_t)(pkt->at.tv_usec)/1000;
-    auto tm = gmtime(&pkt->at.tv_sec);
-    // json-encode all the metadata
-    int len = snprintf(buf, sizeof(buf),
-            "{\"at\":\"%d-%02d-%02dT%02d:%02d:%02d.%03ldZ\","
-             "\"gw\":\"%s\",\"hwid\":\"%x\",\"rssi\":%d,\"snr\":%d,\"fei\":%d,"
-             "\"type\":%d,\"remote_margin\":%d,\"remote_fei\":%d,"
-             "\"payload\":\"",
-             tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-             tm->tm_hour, tm->tm_min, tm->tm_sec, pkt->at.tv_usec/1000,
-             mqTopic, pkt->node, pkt->rssi, pkt->snr, pkt->fei,
-             pkt->fmt, pkt->remMargin, pkt->remFEI);
-    if (len == sizeof(buf)) {
-        printf("OOPS: packet JSON too large\n");
-        return;
+// queuePacket adds a packet to pktQueue, dropping the oldest packet if the queue is full
+void queuePacket(jlPacket *pkt, uint16_t id, uint32_t deadline) {
+    portENTER_CRITICAL(&pktQueueMux);
+    jlPacket *evicted = pktQueue.push(pkt, id, deadline);
+    portEXIT_CRITICAL(&pktQueueMux);
+    if (evicted) {
+        EVLOG(EV_QUEUE_FULL, evicted->node, evicted->at.tv_sec);
+        pktPool.free(evicted);
     }
-    // add the payload as a base64 encoded string
-    if (pkt->dataLen > 0) {
-        int paylen = base64_encode_expected_len(pkt->dataLen);
-        if (len+paylen+2 >= sizeof(buf)) {
-            printf("OOPS: packet JSON too large: need %d\n", len+paylen+2);
-            return;
+}
+
+// rxFormat selects the format(s) in which packets are published
+#define RX_FMT_JSON 1 // JSON on <topic>/rx
+#define RX_FMT_CBOR 2 // CBOR on <topic>/rxb, see encodeRxCbor
+uint8_t rxFormat = RX_FMT_JSON;
+DV(rxFormat);
+
+uint32_t pubNum = 0; // number of packet publishes, single or batched
+
+// appendf appends to a message that is built in pieces in buf, which holds size characters
+// including the terminating null. Output that doesn't fit is truncated and len stays within buf.
+static void appendf(char *buf, int size, int &len, const char *fmt, ...) {
+    if (len >= size-1) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf+len, size-len, fmt, ap);
+    va_end(ap);
+    if (n > 0) len = len+n < size-1 ? len+n : size-1;
+}
+
+//===== Packet timing, see timing.h
+
+#if PKT_TIMING
+PktTiming pktTiming;
+
+// pktPublished timestamps the publication of a packet
+void pktPublished(jlPacket *pkt) {
+    uint32_t now = esp_timer_get_time();
+    if (pkt->ts[PKT_PUB1] != 0) pktTiming.rexmit.record(now - pkt->ts[PKT_PUB]);
+    else pkt->ts[PKT_PUB1] = now;
+    pkt->ts[PKT_PUB] = now;
+}
+
+// pktAcked records the time spent in each stage once the broker acknowledged a packet
+void pktAcked(jlPacket *pkt) {
+    if (pkt->ts[PKT_RX] == 0) return; // replayed packet
+    uint32_t now = esp_timer_get_time();
+    uint32_t *ts = pkt->ts;
+    pktTiming.radio.record(ts[PKT_READ] - ts[PKT_RX]);
+    pktTiming.ack.record(ts[PKT_ACK] - ts[PKT_READ]);
+    pktTiming.decode.record(ts[PKT_DECODE] - ts[PKT_ACK]);
+    pktTiming.ring.record(ts[PKT_POP] - ts[PKT_DECODE]);
+    pktTiming.publish.record(ts[PKT_PUB1] - ts[PKT_POP]);
+    pktTiming.puback.record(now - ts[PKT_PUB]);
+    pktTiming.total.record(now - ts[PKT_RX]);
+}
+
+// timingReport appends the stage latency percentiles to the stats message, it returns the
+// length appended, at most size-1
+int timingReport(char *buf, int size) {
+    static const char *names[] = {
+        "radio", "ack", "decode", "ring", "publish", "puback", "rexmit", "total" };
+    PktTiming &t = pktTiming;
+    LogHistogram *h[] = {
+        &t.radio, &t.ack, &t.decode, &t.ring, &t.publish, &t.puback, &t.rexmit, &t.total };
+    int len = 0;
+    appendf(buf, size, len, ",\"latUs\":{");
+    for (int i=0; i<8; i++) {
+        appendf(buf, size, len, "%s\"%s\":[%u,%u,%u,%u]", i ? "," : "", names[i],
+                h[i]->percentile(50), h[i]->percentile(90), h[i]->percentile(99), h[i]->max);
+    }
+    appendf(buf, size, len, "}");
+    return len;
+}
+#else
+static inline void pktPublished(jlPacket *pkt) { }
+static inline void pktAcked(jlPacket *pkt) { }
+#endif
+
+// publishPacket encodes a packet and publishes it to the MQTT broker in the format(s) selected by
+// rxFormat. It returns the MQTT message id, which is 0 if the publish failed and -1 if the packet
+// cannot be encoded. If both formats are enabled the id is the one of the JSON message.
+int publishPacket(jlPacket *pkt, bool rexmit) {
+    char topic[41+6];
+    int id = -1;
+    if (rxFormat & RX_FMT_JSON) {
+        char buf[RX_JSON_MAX];
+        int len = encodeRxJson(pkt, mqTopic, buf, sizeof(buf));
+        if (len < 0) {
+            EVLOG(EV_TX_JSON_BIG);
+        } else {
+            strcpy(topic, mqTopic);
+            strcat(topic, "/rx");
+            id = mqttClient.publish(topic, 1, false, buf, len, rexmit);
+            pubNum++;
+            EVLOG(rexmit ? EV_RETX : EV_TX, pkt->node, pkt->at.tv_sec, id, len);
+            //printf("JSON: %s\n", buf);
         }
-        len += base64_encode_chars((char*)pkt->data, pkt->dataLen, buf+len);
-        buf[len++] = '"';
-    }
-    // add the varint-decoded payload as data array
-    if (pkt->dataLen > 0) {
-        int32_t data[20];
-        int c = decodeVarints(pkt->data, pkt->dataLen, data, 20);
-        if (c > 0) {
-            len += snprintf(buf+len, sizeof(buf)-len-2, ",\"data\":[");
-            for (int i=0; i<c; i++)
-                len += snprintf(buf+len, sizeof(buf)-len-2, "%d%c", data[i], i==c-1?']':',');
+    }
+    if (rxFormat & RX_FMT_CBOR) {
+        uint8_t buf[RX_CBOR_MAX];
+        int len = encodeRxCbor(pkt, mqTopic, buf, sizeof(buf));
+        if (len < 0) {
+            EVLOG(EV_TX_CBOR_BIG);
         } else {
-            printf("Cannot decode varints: %d\n", c);
+            strcpy(topic, mqTopic);
+            strcat(topic, "/rxb");
+            uint16_t cid = mqttClient.publish(topic, 1, false, (char *)buf, len, rexmit);
+            pubNum++;
+            if (id < 0) id = cid;
+            EVLOG(rexmit ? EV_RETX_CBOR : EV_TX_CBOR, pkt->node, pkt->at.tv_sec, cid, len);
         }
     }
-    buf[len++] = '}';
-    buf[len  ] = 0;
-    // send off the packet
-    char topic[41+6];
-    strcpy(topic, mqTopic);
-    strcat(topic, "/rx");
-    uint16_t id = mqttClient.publish(topic, 1, false, buf, len, rexmit);
-    printf("MQTT TX from %x at %ld %ssent, id=%d len=%d\n",
-            pkt->node, pkt->at.tv_sec, rexmit?"re":"", id, len);
-    //printf("JSON: %s\n", buf);
     pkt->mqAt = millis();
-    pktBuffer[id] = pkt;
+    pktPublished(pkt);
+    return id;
+}
+
+//===== Batching of packets into a single MQTT message
+
+// rxBatchMs > 0 enables batching: packets are collected for up to rxBatchMs milliseconds or
+// rxBatchBytes bytes and published as a JSON array on <topic>/rx, resp. as an indefinite-length
+// CBOR array on <topic>/rxb. Each packet of a batch is queued in pktQueue with the batch's MQTT
+// message id, so it is freed when the batch is acknowledged and retransmitted on its own if not.
+uint32_t rxBatchMs = 0;
+uint32_t rxBatchBytes = 1024;
+DV(rxBatchMs); DV(rxBatchBytes);
+#define RX_BATCH_MAX  2048 // max bytes in a batch message
+#define RX_BATCH_PKTS 32   // max packets in a batch
+
+struct RxBatch {
+    char json[RX_BATCH_MAX];
+    uint8_t cbor[RX_BATCH_MAX];
+    int jsonLen, cborLen;       // bytes in each buffer, 0 if the format is not used
+    int count;                  // number of packets in the batch
+    uint32_t openedAt;          // millis when the first packet was added
+    uint32_t addedSum;          // sum of millis when each packet was added, for latency stats
+    jlPacket *pkts[RX_BATCH_PKTS];
+};
+static RxBatch rxBatch;
+uint32_t batchNum = 0, batchPktNum = 0, batchLatSum = 0;
+
+// batchAppend adds a packet to the current batch, returns false if it doesn't fit
+bool batchAppend(jlPacket *pkt) {
+    RxBatch &b = rxBatch;
+    int max = rxBatchBytes < RX_BATCH_MAX ? rxBatchBytes : RX_BATCH_MAX;
+    if (b.count == RX_BATCH_PKTS) return false;
+    // encode into the free space after the separator, leaving room for the array terminator
+    int jl = 0, cl = 0;
+    if (rxFormat & RX_FMT_JSON) {
+        jl = encodeRxJson(pkt, mqTopic, b.json+b.jsonLen+1, max-b.jsonLen-2);
+        if (jl < 0) return false;
+        b.json[b.jsonLen] = b.count == 0 ? '[' : ',';
+        jl++;
+    }
+    if (rxFormat & RX_FMT_CBOR) {
+        int off = b.count == 0 ? 1 : 0;
+        cl = encodeRxCbor(pkt, mqTopic, b.cbor+b.cborLen+off, max-b.cborLen-off-1);
+        if (cl < 0) return false;
+        if (off) b.cbor[0] = 0x9f; // indefinite-length array
+        cl += off;
+    }
+    b.jsonLen += jl;
+    b.cborLen += cl;
+    uint32_t now = millis();
+    if (b.count == 0) b.openedAt = now;
+    b.addedSum += now;
+    b.pkts[b.count++] = pkt;
+    return true;
+}
+
+// batchFlush publishes the current batch and queues its packets until they're acknowledged
+void batchFlush() {
+    RxBatch &b = rxBatch;
+    if (b.count == 0) return;
+    char topic[41+6];
+    int id = -1;
+    if (b.jsonLen > 0) {
+        b.json[b.jsonLen++] = ']';
+        strcpy(topic, mqTopic);
+        strcat(topic, "/rx");
+        id = mqttClient.publish(topic, 1, false, b.json, b.jsonLen, false);
+        pubNum++;
+    }
+    if (b.cborLen > 0) {
+        b.cbor[b.cborLen++] = 0xff; // break
+        strcpy(topic, mqTopic);
+        strcat(topic, "/rxb");
+        uint16_t cid = mqttClient.publish(topic, 1, false, (char *)b.cbor, b.cborLen, false);
+        pubNum++;
+        if (id < 0) id = cid;
+    }
+    uint32_t now = millis();
+    EVLOG(EV_TX_BATCH, b.count, now-b.openedAt, id, b.jsonLen, b.cborLen);
+    batchNum++;
+    batchPktNum += b.count;
+    batchLatSum += now*b.count - b.addedSum;
+    for (int i=0; i<b.count; i++) {
+        b.pkts[i]->mqAt = now;
+        pktPublished(b.pkts[i]);
+        queuePacket(b.pkts[i], id, now + REXMIT_MS);
+    }
+    b.count = b.jsonLen = b.cborLen = 0;
+    b.addedSum = 0;
+}
+
+// sendPacket forwards a packet to the MQTT broker and queues it until the broker acknowledges it
+void sendPacket(jlPacket *pkt) {
+    if (rxBatchMs > 0) {
+        if (batchAppend(pkt)) return;
+        batchFlush();
+        if (batchAppend(pkt)) return;
+        // the packet doesn't fit into a batch by itself, send it individually
+    }
+    int id = publishPacket(pkt, false);
+    if (id < 0) {
+        pktPool.free(pkt);
+        return;
+    }
+    queuePacket(pkt, id, pkt->mqAt + REXMIT_MS);
 }
 
 // onMqttPublish is called when a publish with QoS=1 succeeds. If the callback is for a packet
-// in the buffer then remove that packet: we're done. Else ignore the callback.
+// in the queue then remove that packet: we're done. Else ignore the callback. All the packets of
+// a batch share the batch's id.
 void onMqttPublish(uint16_t id) {
     mqttTxNum++;
-    auto iter = pktBuffer.find(id);
-    if (iter != pktBuffer.end()) {
-        free(iter->second);
-        pktBuffer.erase(iter);
+    while (true) {
+        portENTER_CRITICAL(&pktQueueMux);
+        jlPacket *pkt = pktQueue.remove(id);
+        portEXIT_CRITICAL(&pktQueueMux);
+        if (!pkt) break;
+        pktAcked(pkt);
+        pktPool.free(pkt);
+    }
+    loopWake(); // the drain window may have opened
+}
+
+//===== Backlog drain
+
+// Retransmissions and the backlog left by an outage (packets queued in pktQueue and logged to
+// flash while MQTT was disconnected) are published oldest first at drainPps with at most
+// drainWindow packets waiting for their PUBACK. Live packets are published as they arrive and
+// count against the window, so they take priority over the backlog rather than queueing behind it.
+uint32_t drainPps = 100;    // max rate at which retransmissions and backlog are published
+uint32_t drainWindow = 16;  // backlog publishing pauses while this many packets are in flight
+DV(drainPps); DV(drainWindow);
+uint32_t drainNum = 0;      // packets published from the backlog, incl. retransmissions
+uint32_t rexmitNum = 0;     // retransmissions of packets that didn't get a PUBACK
+int inFlightMax = 0;        // max packets in flight
+static uint32_t drainAt;    // micros when the next backlog packet may be published
+
+extern FlashLog flashLog;
+bool logReplay();
+
+// drainReady returns whether the next backlog packet may be published
+bool drainReady() {
+    int n = pktQueue.inFlight();
+    if (n > inFlightMax) inFlightMax = n;
+    return (int32_t)(micros() - drainAt) >= 0 && n < (int)drainWindow;
+}
+
+// drainSent accounts for a backlog packet that got published
+void drainSent() {
+    uint32_t now = micros();
+    uint32_t gap = 1000000 / (drainPps ? drainPps : 1);
+    // catch up on a slow loop() iteration but don't build up a burst after an idle period
+    drainAt = (int32_t)(now - drainAt) < (int32_t)gap ? drainAt + gap : now + gap;
+    drainNum++;
+}
+
+// drainProgress prints the progress of draining a backlog larger than the window every few
+// seconds, smaller ones are routine retransmissions
+void drainProgress() {
+    static bool draining = false;
+    static uint32_t start, lastPrint, startNum;
+    int backlog = pktQueue.due() + flashLog.pending;
+    if (!draining && backlog > (int)drainWindow) {
+        draining = true;
+        start = lastPrint = millis();
+        startNum = drainNum;
+        printf("Drain: %d packets backlog\n", backlog);
+    } else if (draining && backlog > 0 && millis() - lastPrint > 5000) {
+        lastPrint = millis();
+        printf("Drain: %d packets published, %d to go, %d in flight\n", drainNum-startNum,
+                backlog, pktQueue.inFlight());
+    } else if (draining && backlog == 0) {
+        draining = false;
+        printf("Drain: %d packets published in %dms\n", drainNum-startNum, millis()-start);
     }
 }
 
+// packetLoop flushes the current batch when it's due and, paced by drainReady, retransmits
+// packets that the broker hasn't acknowledged in time as well as packets that were queued while
+// MQTT was disconnected, then publishes packets from the flash log.
+// The cost per call does not depend on the number of queued packets.
 void packetLoop() {
-    // check whether we should rexmit any packet
-    if (mqttConn) {
-        uint32_t now = millis();
-        for (auto iter=pktBuffer.begin(); iter!=pktBuffer.end(); ) {
-            jlPacket *pkt = iter->second;
-            if (!pkt) { printf("OOPS: NULL pkt in pkBuffer at %d\n", iter->first); continue; }
-            if (now - pkt->mqAt > 1100) {
-                printf("Rexmit %d\n", iter->first);
-                pktBuffer.erase(iter++);
-                sendPacket(pkt, true);
-            } else iter++;
+    if (rxBatch.count > 0 && millis() - rxBatch.openedAt >= rxBatchMs) batchFlush();
+    if (rxBatch.count > 0) loopNext(rxBatch.openedAt + rxBatchMs);
+    if (!mqttConn) return;
+    uint32_t now = millis();
+    while (drainReady()) {
+        portENTER_CRITICAL(&pktQueueMux);
+        int slot = pktQueue.nextDue(now);
+        jlPacket *pkt = slot >= 0 ? pktQueue.packet(slot) : 0;
+        portEXIT_CRITICAL(&pktQueueMux);
+        if (!pkt) {
+            // pktQueue's backlog is drained, continue with the flash log
+            if (!logReplay()) break;
+            drainSent();
+            continue;
         }
+
+        // packets queued while MQTT was disconnected have not been published yet
+        bool rexmit = pkt->mqAt != 0;
+        if (rexmit) rexmitNum++;
+        EVLOG(rexmit ? EV_REXMIT : EV_BACKLOG, pkt->node, pkt->at.tv_sec);
+        int id = publishPacket(pkt, rexmit);
+        portENTER_CRITICAL(&pktQueueMux);
+        if (id >= 0) pktQueue.update(slot, id, now + REXMIT_MS);
+        else pktQueue.removeAt(slot);
+        portEXIT_CRITICAL(&pktQueueMux);
+        if (id < 0) pktPool.free(pkt);
+        drainSent();
     }
-    // check whether we need to drop some packets
-    if (pktBuffer.size() > 100) {
-        int drop = pktBuffer.size() - 100;
-        struct timeval now;
-        gettimeofday(&now, 0);
-        printf("pktBuffer: dropping %d packets\n", drop);
-        for (auto iter=pktBuffer.begin(); drop>0 && iter!=pktBuffer.end(); ) {
-            jlPacket *pkt = iter->second;
-            if (!pkt) { printf("OOPS: NULL pkt in pkBuffer at %d\n", iter->first); continue; }
-            if (now.tv_sec - pkt->at.tv_sec > 5000) {
-                free(pkt);
-                pktBuffer.erase(iter++);
-                drop--;
-            } else iter++;
-        }
-        printf("pktBuffer: %d packets left\n", pktBuffer.size());
+    drainProgress();
+    // run again when the next backlog packet may be published or retransmissions may be due
+    if (pktQueue.due() > 0 || flashLog.pending > 0) {
+        int32_t us = drainAt - micros();
+        loopNext(now + (us > 0 ? (us+999)/1000 : 0));
     }
+    if (pktQueue.size() > 0) loopNext(now + PacketQueue::TICK_MS);
 }
 
 uint32_t rfTxNum = 0, rfRxNum = 0;
+uint32_t rfBadNum = 0; // packets that could not be decoded
 
-void rfLoop(bool mqConn) {
-    static uint8_t pktbuf[70];
-    int len = radio.receive(pktbuf, sizeof(pktbuf));
-    if (len <= 0) return;
-    rfRxNum++;
-    digitalWrite(LED_RF, LED_ON);
-    rfLed = millis();
+// rxRing hands decoded packets from the radio task to the MQTT publisher in loop()
+#ifndef RX_RING_SIZE
+#define RX_RING_SIZE 32
+#endif
+static SPSCRing<jlPacket*, RX_RING_SIZE> rxRing;
+
+//===== RF capture and replay, see capture.h
+
+uint8_t rfCapture = 0;      // 1: publish received frames on <topic>/capture
+uint32_t replaySpeed = 1;   // replay speed-up factor, 0: as fast as possible
+DV(rfCapture); DV(replaySpeed);
+
+static SPSCRing<CaptureSlot, 32> captureRing; // captured frames: radio task -> loop()
+uint32_t captureNum = 0, replayNum = 0;
+
+// replayBuf holds a replay message, it is filled by the MQTT callback while replayLen is 0 and
+// then drained by the radio task, which sets replayLen back to 0 when done.
+static uint8_t replayBuf[4096];
+static std::atomic<int> replayLen{0};
+static int replayOff = 0;               // offset of the next record, radio task only
+static uint64_t replayT0, replayStart;  // first record's timestamp and when it was replayed
+
+// onReplayMessage copies a (possibly fragmented) replay message into replayBuf
+void onReplayMessage(const char *payload, size_t len, size_t index, size_t total) {
+    static bool copying = false;
+    if (index == 0) copying = total <= sizeof(replayBuf) && replayLen.load() == 0;
+    if (!copying) {
+        if (index == 0) printf("Replay: busy or message too large, dropping %u bytes\n", (unsigned)total);
+        return;
+    }
+    memcpy(replayBuf+index, payload, len);
+    if (index+len == total) replayLen.store(total, std::memory_order_release);
+}
+
+// replayNext returns the next record of the replay message if it is due, else NULL
+const CaptureRecord *replayNext() {
+    int total = replayLen.load(std::memory_order_acquire);
+    if (total == 0) return 0;
+    const uint8_t *p = replayBuf + replayOff;
+    const CaptureRecord *r = captureNext(p, replayBuf+total);
+    if (!r) {
+        if (replayOff < total) printf("Replay: truncated record at offset %d\n", replayOff);
+        replayOff = 0;
+        replayLen.store(0, std::memory_order_release);
+        return 0;
+    }
+    uint64_t now = esp_timer_get_time();
+    if (replayOff == 0) {
+        replayT0 = captureUs(r);
+        replayStart = now;
+    }
+    if (replaySpeed > 0 && (captureUs(r) - replayT0)/replaySpeed > now - replayStart) return 0;
+    replayOff = p - replayBuf;
+    return r;
+}
+
+// captureLoop publishes captured frames from loop(), packing as many records as fit into each
+// message. Captured frames are dropped while MQTT is disconnected.
+void captureLoop(bool mqConn) {
+    static uint8_t msg[1024];
+    int len = 0;
+    char topic[41+9];
+    strcpy(topic, mqTopic);
+    strcat(topic, "/capture");
+    CaptureSlot slot;
+    while (captureRing.pop(slot)) {
+        if (!mqConn) continue;
+        if (len + slot.size() > (int)sizeof(msg)) {
+            mqttClient.publish(topic, 0, false, (char *)msg, len);
+            len = 0;
+        }
+        memcpy(msg+len, slot.buf, slot.size());
+        len += slot.size();
+        captureNum++;
+    }
+    if (len > 0) mqttClient.publish(topic, 0, false, (char *)msg, len);
+}
+
+//===== Flash log: store and forward while MQTT is disconnected, see flashlog.h
+
+#ifndef FLASH_LOG_KB
+#define FLASH_LOG_KB 256 // max size of the log, the pktlog partition may limit it further
+#endif
+uint32_t logFlushMs = 2000;  // max time logged packets stay in RAM before being written to flash
+DV(logFlushMs);
+
+FlashLog flashLog;
+static bool logReady = false; // the pktlog partition was found, set before the radio task starts
+static SPSCRing<CaptureSlot, 32> logRing; // frames to log: radio task -> loop()
+
+// logSetup finds the pktlog partition and recovers the log left by the previous boot
+void logSetup() {
+    const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+            (esp_partition_subtype_t)0x40, "pktlog");
+    if (!p) {
+        printf("Flash log: no pktlog partition, packets are only queued in RAM\n");
+        return;
+    }
+    logReady = flashLog.begin(p, FLASH_LOG_KB*1024);
+    printf("Flash log: %dKB, %d packets pending, %d corrupt records\n",
+            p->size/1024, flashLog.pending, flashLog.corrupt);
+}
+
+// logLoop writes the frames received while MQTT is disconnected to the flash log
+void logLoop(bool mqConn) {
+    if (!logReady) return;
+    CaptureSlot slot;
+    while (logRing.pop(slot)) flashLog.append(slot.buf, slot.size());
+    uint32_t at = flashLog.bufferedAt();
+    if (at && (mqConn || millis() - at >= logFlushMs)) flashLog.flush();
+}
+
+// logReplay publishes the oldest logged packet, it returns false if there is none or if the
+// packet pool is running low. It is paced by packetLoop.
+bool logReplay() {
+    if (!logReady || flashLog.pending == 0 || pktPool.available() < PKT_POOL_SIZE/4) return false;
+    CaptureSlot slot;
+    int len = flashLog.next(slot.buf, sizeof(slot.buf));
+    if (len == 0) return false;
+    CaptureRecord *r = (CaptureRecord *)slot.buf;
+    jlPacket *pkt = 0;
+    if (len >= (int)sizeof(CaptureRecord) && len == slot.size()) {
+        struct timeval rxAt;
+        rxAt.tv_sec = r->sec;
+        rxAt.tv_usec = r->usec;
+        pkt = processRFPacket(r->data, r->len, rxAt, -r->rssi/2, r->margin, r->afc);
+    }
+    flashLog.consume();
+    if (!pkt) {
+        EVLOG(EV_LOG_BAD);
+        return true;
+    }
+    sendPacket(pkt);
+    return true;
+}
+
+//===== Streaming OTA over MQTT, see ota.h
+
+OtaWriter ota;
+uint32_t otaUpdates = 0;    // ota.updates when otaRfRx and otaHeapMin were reset
+uint32_t otaRfRx = 0;       // rfRxNum when the update started
+uint32_t otaHeapMin = 0;    // lowest free heap seen during the update
+uint32_t otaMs = 0, otaRx = 0; // duration of the update and RF packets received meanwhile
+volatile uint32_t otaRebootAt = 0; // millis when to boot the new image, 0: not scheduled
+
+// otaSetup selects the partition the next image goes to
+void otaSetup() {
+    const esp_partition_t *p = esp_ota_get_next_update_partition(0);
+    if (!p) printf("OTA: no update partition\n");
+    ota.begin(p);
+}
+
+// otaStatus publishes the progress of the update, retained so a sender that (re)connects learns
+// where to continue
+void otaStatus() {
+    static const char *const states[] = { "idle", "running", "done", "failed" };
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+            "{\"id\":%u,\"size\":%u,\"next\":%u,\"state\":\"%s\",\"chunks\":%u,\"bad\":%u,"
+            "\"skipped\":%u,\"ms\":%u,\"heapMin\":%u,\"rfRx\":%u}",
+            ota.imageId, ota.imageSize, ota.next, states[ota.state], ota.chunks, ota.bad,
+            ota.skipped, otaMs, otaHeapMin, otaRx);
+    char topic[41+11];
+    strcpy(topic, mqTopic);
+    strcat(topic, "/ota/status");
+    mqttClient.publish(topic, 1, true, buf, len);
+}
+
+// otaMessage handles a fragment of a <topic>/ota/chunk message, it runs in the MQTT client's task
+// while the radio task keeps receiving
+void otaMessage(const char *payload, size_t len, size_t index, size_t total) {
+    bool end = ota.fragment((const uint8_t *)payload, len, index, total);
+    if (ota.updates != otaUpdates) {
+        // a new update started
+        otaUpdates = ota.updates;
+        otaRfRx = rfRxNum;
+        otaHeapMin = ESP.getFreeHeap();
+    }
+    if (ota.state == OTA_RUNNING) {
+        uint32_t heap = ESP.getFreeHeap();
+        if (heap < otaHeapMin) otaHeapMin = heap;
+    }
+    if (!end) return;
+    if (ota.state == OTA_RUNNING || (ota.state == OTA_DONE && !otaRebootAt)) {
+        otaMs = millis() - ota.startedAt;
+        otaRx = rfRxNum - otaRfRx;
+    }
+    if (ota.state == OTA_DONE && !otaRebootAt) {
+        // esp_ota_set_boot_partition validates the image before selecting it
+        esp_err_t err = esp_ota_set_boot_partition(ota.part);
+        if (err == ESP_OK) {
+            printf("OTA: image of %u bytes received in %ums, %u RF packets received meanwhile, "
+                    "min free heap %u\n", ota.imageSize, otaMs, otaRx, otaHeapMin);
+            otaRebootAt = (millis() + 2000) | 1; // leave time to publish the status
+            loopWake();
+        } else {
+            printf("OTA: image failed validation, err %d\n", err);
+            ota.fail();
+        }
+    }
+    otaStatus();
+}
+
+//===== ACK fast path
+
+// ACKs must start within ACK_DEADLINE_US of the end of the packet, so they are sent by the radio
+// task straight from the raw packet, before it gets decoded, logged and queued for MQTT.
+// This assumes radio.rxAt is taken at the end of the packet.
+#define ACK_DEADLINE_US 10000
+uint32_t ackGapUs = 1000; // time between packet end and ACK for the node to switch to RX
+DV(ackGapUs);
+LogHistogram ackLatency;  // packet end -> ACK TX start, in us
+uint32_t ackLate = 0;     // ACKs dropped because the deadline passed
+
+// rxEndUs converts the packet end time to the esp_timer clock
+int64_t rxEndUs(struct timeval rxAt) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return esp_timer_get_time() -
+        ((int64_t)(now.tv_sec - rxAt.tv_sec)*1000000 + now.tv_usec - rxAt.tv_usec);
+}
 
-    jlPacket *pkt = processRFPacket(pktbuf, len, radio.rxAt, -radio.rssi/2, radio.margin, radio.afc);
+// v2Ack is the v2 ACK frame: header, node ID, format 0 with info trailer, SNR, FEI/128
+static uint8_t v2Ack[8] = { 0, 0, 0, 0, 0, 0x80, 0, 0 };
+
+// rfAck decides whether to ACK a packet and, unless radio is NULL, transmits the ACK on the
+// radio the packet came from. It returns whether the packet is considered ACKed.
+bool rfAck(Radio *radio, const uint8_t *pktbuf, int len, struct timeval rxAt, uint8_t snr,
+        int16_t fei)
+{
+    uint32_t node;
+    int vers = jlAckRequest(pktbuf, len, &node);
+    if (vers == 0 || rxAt.tv_sec == 0) return false;
+    if (!nrw.shouldAck(node, snr, ackMode)) return false;
+    if (!radio) return true;
+
+    // wait for the gap
+    int64_t rxEnd = rxEndUs(rxAt);
+    while (esp_timer_get_time() - rxEnd < ackGapUs)
+        ;
+    int64_t lat = esp_timer_get_time() - rxEnd;
+    if (lat > ACK_DEADLINE_US) {
+        ackLate++;
+        return false;
+    }
+
+    bool sent;
+    if (vers == 1) {
+        uint8_t ack[3] = { 0x80, snr, (uint8_t)(fei/128) }; // fmt=0, got info trailer
+        ackLatency.record(lat);
+        sent = radio->sx->send(61, ack, 3);
+    } else {
+        // mirror the header's parity and version bits, set special (ACK) and from-GW
+        v2Ack[0] = (pktbuf[0] & 0x83) | 0x40 | 0x20;
+        memcpy(v2Ack+1, pktbuf+1, 4);
+        v2Ack[6] = snr;
+        v2Ack[7] = fei/128;
+        ackLatency.record(lat);
+        sent = radio->sendRaw(v2Ack, sizeof(v2Ack));
+    }
+    if (!sent) {
+        EVLOG(EV_ACK_FAIL, radio->index);
+    } else {
+        rfTxNum++;
+        radio->txNum++;
+    }
+    return sent;
+}
+
+// rfProcess decodes a packet, it returns NULL if the packet is to be dropped
+jlPacket *rfProcess(uint8_t *pktbuf, int len, struct timeval rxAt, int8_t rssi, uint8_t snr,
+        int16_t fei, bool acked)
+{
+    jlPacket *pkt = processRFPacket(pktbuf, len, rxAt, rssi, snr, fei);
     // undecodable packet
     if (!pkt) {
-        printf("Cannot decode packet:");
-        for (int i=0; i<len; i++) printf(" %02x", pktbuf[i]);
-        putchar('\n');
-        return;
+        if (pktPool.available() == 0) {
+            EVLOG(EV_POOL_EMPTY);
+            return 0;
+        }
+        rfBadNum++;
+        EVLOG_BYTES(EV_RX_BAD, pktbuf, len);
+        return 0;
     }
     // packet from another GW - ignore
     if (pkt->node == 0) {
-        printf("RF RX %08x [%c%c%c%c%c]{%d} %ddBm %dHz [Ignoring packet from another GW]\n",
-                pkt->node, pkt->isAck?'A':'.', pkt->fromGW?'>':'<',
+        EVLOG(EV_RX_GW, pkt->node, pkt->isAck?'A':'.', pkt->fromGW?'>':'<',
                 pkt->ackReq?'Q':'.', pkt->special?'S':'.', pkt->trailer?'T':'.',
-                pkt->fmt, -radio.rssi/2, radio.afc);
-        return;
+                pkt->fmt, rssi, fei);
+        pktPool.free(pkt);
+        return 0;
     }
 
-    // decide whether to ACK and doit
-    bool shouldAck = nrw.shouldAck(pkt->node) && radio.rxAt.tv_sec;
-    if (shouldAck) {
-        uint8_t ack[5];
-        if (pkt->vers == 0) {
-            ack[0] = 0x80; // fmt=0, got info trailer
-            ack[1] = (uint8_t)pkt->snr;
-            ack[2] = (uint8_t)(pkt->fei/128);
-            delayMicroseconds(1000);
-            bool sent = radio.send(61, ack, 3);
-            if (!sent) printf("OOPS: couldn't sent ACK\n");
-            else rfTxNum++;
+    pkt->acked = acked;
+    return pkt;
+}
+
+// rfLoop runs in the radio task: it processes a packet received by a radio. It returns false if
+// there was no packet to process.
+bool rfLoop(Radio &r) {
+    static uint8_t pktbuf[JL_MAX_PKT];
+    SX1276fsk &sx = *r.sx;
+    int len = sx.receive(pktbuf, sizeof(pktbuf));
+    if (len <= 0) return false;
+#if PKT_TIMING
+    uint32_t tRead = esp_timer_get_time();
+#endif
+    rfRxNum++;
+    r.rxNum++;
+    bool acked = rfAck(&r, pktbuf, len, sx.rxAt, sx.margin, sx.afc);
+#if PKT_TIMING
+    uint32_t tAck = esp_timer_get_time();
+#endif
+    digitalWrite(LED_RF, LED_ON);
+    rfLed = millis();
+    if (rfCapture) {
+        CaptureSlot slot;
+        captureRecord(slot, pktbuf, len, sx.rxAt, sx.rssi, sx.margin, sx.afc);
+        captureRing.push(slot);
+    }
+    jlPacket *pkt = rfProcess(pktbuf, len, sx.rxAt, -sx.rssi/2, sx.margin, sx.afc, acked);
+    if (!pkt) return true;
+    // while MQTT is disconnected the packet is logged to flash rather than queued in RAM
+    if (logReady && !mqttConn) {
+        CaptureSlot slot;
+        captureRecord(slot, pktbuf, len, sx.rxAt, sx.rssi, sx.margin, sx.afc);
+        pkt->logged = logRing.push(slot);
+    }
+#if PKT_TIMING
+    pkt->ts[PKT_RX] = rxEndUs(sx.rxAt);
+    pkt->ts[PKT_READ] = tRead;
+    pkt->ts[PKT_ACK] = tAck;
+    PKT_STAMP(pkt, PKT_DECODE);
+#endif
+    // hand the packet to the MQTT side
+    if (!rxRing.push(pkt)) pktPool.free(pkt);
+    return true;
+}
+
+// rfReplay runs in the radio task: it processes the next replayed packet if it is due. It returns
+// false if there was none.
+bool rfReplay() {
+    static uint8_t pktbuf[JL_MAX_PKT];
+    const CaptureRecord *r = replayNext();
+    if (!r) return false;
+    replayNum++;
+    struct timeval at;
+    at.tv_sec = r->sec;
+    at.tv_usec = r->usec;
+    memcpy(pktbuf, r->data, r->len);
+    // replayed packets go through the ACK decision but no ACK is transmitted
+    bool acked = rfAck(0, pktbuf, r->len, at, r->margin, r->afc);
+    jlPacket *pkt = rfProcess(pktbuf, r->len, at, -r->rssi/2, r->margin, r->afc, acked);
+    if (pkt && !rxRing.push(pkt)) pktPool.free(pkt);
+    return true;
+}
+
+// rfTask services the radios, it runs pinned to the core that doesn't run loop(). Each pass
+// processes at most one packet per radio so they get serviced fairly, replayed packets are
+// processed when the radios are idle.
+#ifndef RF_TASK_CORE
+#define RF_TASK_CORE 0
+#endif
+#ifndef RF_TASK_PRIO
+#define RF_TASK_PRIO 10
+#endif
+void rfTask(void *arg) {
+    memTag = MEM_RF; // the packet path should not allocate, this shows if it does
+    while (true) {
+        bool busy = false;
+        for (int i=0; i<rfNum; i++)
+            if (rfLoop(radios[i])) busy = true;
+        if (busy || rfReplay()) loopWake();
+        else vTaskDelay(1);
+    }
+}
+
+//===== Uplink de-duplication across gateways, see dedup.h
+
+#define DEDUP_OFF    0
+#define DEDUP_ON     1 // only the designated gateway publishes a packet
+#define DEDUP_RECORD 2 // the others publish a compact reception record on <topic>/rxr instead
+uint8_t rxDedup = DEDUP_OFF;
+uint32_t dedupMs = 500; // time to wait for the designated gw's report, must exceed gossipMs
+DV(rxDedup); DV(dedupMs);
+
+DedupCache<jlPacket*, DEDUP_SLOTS> dedup;
+
+// publishReception publishes the reception info of a packet suppressed by de-duplication so the
+// backend still learns which gateways hear the node
+void publishReception(jlPacket *pkt) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf),
+            "{\"at\":%ld.%03ld,\"hwid\":\"%x\",\"type\":%d,\"hash\":%u,\"rssi\":%d,\"snr\":%d}",
+            (long)pkt->at.tv_sec, (long)pkt->at.tv_usec/1000, pkt->node, pkt->fmt,
+            dedupHash(pkt->fmt, pkt->data, pkt->dataLen), pkt->rssi, pkt->snr);
+    char topic[41+4];
+    strcpy(topic, mqTopic);
+    strcat(topic, "/rxr");
+    mqttClient.publish(topic, 0, false, buf, len);
+}
+
+// onPeerPublished is called by the NodeRegistryWorker when another gateway published a packet
+void onPeerPublished(uint32_t node, uint16_t hash) {
+    dedup.peerPublished(node, hash);
+    loopWake();
+}
+
+// dedupLoop publishes held packets that timed out and drops those another gateway published
+void dedupLoop(bool mqConn) {
+    jlPacket *pkt;
+    bool suppress;
+    while (dedup.poll(pkt, suppress)) {
+        if (suppress) {
+            if (rxDedup == DEDUP_RECORD && mqConn) publishReception(pkt);
+            pktPool.free(pkt);
         } else {
-            // TODO: send ACK for v2 format
-            printf("OOPS: V2 ACKs not implemented!\n");
+            if (mqConn) sendPacket(pkt);
+            else queuePacket(pkt, 0, millis());
         }
     }
+}
 
-    // send GW info via MQTT
-    nrw.sendInfo(pkt->node, pkt->snr, shouldAck);
+// rxLoop runs in loop() and forwards packets received by the radio task via MQTT
+void rxLoop(bool mqConn) {
+    jlPacket *pkt;
+    while (rxRing.pop(pkt)) {
+        PKT_STAMP(pkt, PKT_POP);
+        // decide whether to publish the packet now or to leave it to a better placed gateway
+        int action = dedup.PUBLISH;
+        uint16_t hash = 0;
+        if (rxDedup && mqConn && !pkt->logged && pkt->at.tv_sec) {
+            hash = dedupHash(pkt->fmt, pkt->data, pkt->dataLen);
+            action = dedup.add(pkt, pkt->node, hash, nrw.designated(pkt->node), dedupMs);
+        }
+
+        // send GW info via MQTT
+        nrw.sendInfo(pkt->node, pkt->snr, pkt->acked, gossipBinary,
+                action == dedup.PUBLISH ? hash : 0);
 
-    // print packet debug info
-    printf("RF RX %08x [%c%c%c%c%c]{%d} %ddBm %dHz",
-            pkt->node, pkt->isAck?'A':'.', pkt->fromGW?'>':'<',
-            pkt->ackReq?'Q':'.', pkt->special?'S':'.', pkt->trailer?'T':'.',
-            pkt->fmt, -radio.rssi/2, radio.afc);
-    if (pkt->trailer) printf(" {%ddBm %dHz}", pkt->remMargin, pkt->remFEI);
-    printf(" %d:", pkt->dataLen);
-    for (int i=2; i<pkt->dataLen; i++) printf(" %02x", pkt->data[i]);
-    if (shouldAck) printf(" --ACKED\n"); else printf("\n");
+        // log packet debug info
+        int sfx = (pkt->acked ? EVLOG_ACKED : 0) | (action == dedup.HOLD ? EVLOG_HELD : 0) |
+            (action == dedup.SUPPRESS ? EVLOG_DUP : 0);
+        if (pkt->trailer) {
+            EVLOG_BYTES(EV_RX_T, pkt->data+2, pkt->dataLen-2,
+                    pkt->node, pkt->isAck?'A':'.', pkt->fromGW?'>':'<',
+                    pkt->ackReq?'Q':'.', pkt->special?'S':'.', 'T',
+                    pkt->fmt, pkt->rssi, pkt->fei, pkt->remMargin, pkt->remFEI, pkt->dataLen, sfx);
+        } else {
+            EVLOG_BYTES(EV_RX, pkt->data+2, pkt->dataLen-2,
+                    pkt->node, pkt->isAck?'A':'.', pkt->fromGW?'>':'<',
+                    pkt->ackReq?'Q':'.', pkt->special?'S':'.', '.',
+                    pkt->fmt, pkt->rssi, pkt->fei, pkt->dataLen, sfx);
+        }
+        if (pkt->dataLen > 0 && evlogEnabled(EV_RX_NOVARINT)) {
+            int c = varintCount(pkt->data, pkt->dataLen);
+            if (c <= 0) EVLOG(EV_RX_NOVARINT, pkt->node, c);
+        }
 
-    // forward packet via MQTT
-    if (radio.rxAt.tv_sec) {
-        if (mqConn) {
-            sendPacket(pkt, false);
+        // forward packet via MQTT
+        if (action == dedup.HOLD) {
+            // dedupLoop takes care of it
+        } else if (action == dedup.SUPPRESS) {
+            if (rxDedup == DEDUP_RECORD) publishReception(pkt);
+            pktPool.free(pkt);
+        } else if (pkt->logged) {
+            pktPool.free(pkt); // logLoop publishes it from the flash log
+        } else if (pkt->at.tv_sec) {
+            if (mqConn) sendPacket(pkt);
+            else queuePacket(pkt, 0, millis()); // packetLoop sends it once we're connected
         } else {
-            pktBuffer[pkt->at.tv_usec & 0xffff] = pkt; // TODO: handle collisions
+            pktPool.free(pkt);
         }
     }
 }
 
+//===== Battery voltage
+
+#ifdef VBATT
+// The ADC takes ~1ms for the ADC_SAMPLES conversions, so the battery is sampled every vBattMs
+// in a low-priority task on the radio core, where the radio task preempts it, instead of in
+// every loop() iteration.
+uint32_t vBattMs = 1000;
+DV(vBattMs);
+uint32_t vBattUs = 0; // duration of the last sample
+
+#ifndef VBATT_TASK_PRIO
+#define VBATT_TASK_PRIO 1
+#endif
+
+void vBattTask(void *arg) {
+    while (true) {
+        uint32_t t0 = esp_timer_get_time();
+        uint32_t vB = 2 * analogSample(VBATT);
+        vB = vB * 4046/4096;
+        vBatt = vBatt <= 1 ? vB : (vBatt*15+vB)/16;
+        vBattUs = esp_timer_get_time() - t0;
+        vTaskDelay(vBattMs / portTICK_PERIOD_MS);
+    }
+}
+#endif
+
+LogHistogram loopLatency; // duration of loop() iterations, in us
+
 extern uint32_t mqPingMs;
 
 void report() {
     printf("vBatt = %dmV\n", vBatt);
 
-    char buf[256];
-    int len = snprintf(buf, sizeof(buf),
+    char buf[2048];
+    const int size = sizeof(buf)-1; // room for the closing brace
+    int len = 0;
+    appendf(buf, size, len,
             "{\"uptime\":%d,\"rssi\":%d,\"heap\":%d,\"mVbatt\":%d,\"version\":\"%s\"",
             uint32_t(esp_timer_get_time()/1000000), WiFi.RSSI(), ESP.getFreeHeap(), vBatt, __DATE__);
-    len += snprintf(buf+len, sizeof(buf)-len, ",\"rfTx\":%d,\"rfRx\":%d,\"rfNoise\":%d",
-            rfTxNum, rfRxNum, -(radio.bgRssi>>5));
-    len += snprintf(buf+len, sizeof(buf)-len,
+    // fragmentation: percentage of the free heap that can't be allocated in one block
+    uint32_t heap = ESP.getFreeHeap(), heapBlock = ESP.getMaxAllocHeap();
+    appendf(buf, size, len, ",\"heapMin\":%d,\"heapBlock\":%d,\"heapFrag\":%d",
+            ESP.getMinFreeHeap(), heapBlock, heap ? 100 - heapBlock*100/heap : 0);
+#if MEMACCT
+    // per subsystem: [allocations, live allocations, bytes in use, max bytes in use]
+    appendf(buf, size, len, ",\"mem\":{");
+    for (int i=0; i<MEM_NUM; i++) {
+        MemStats m = memAcct.get(i);
+        appendf(buf, size, len, "%s\"%s\":[%u,%u,%u,%u]", i ? "," : "",
+                memTagName[i], m.allocs, m.live, m.bytes, m.highWater);
+    }
+    appendf(buf, size, len, "}");
+#endif
+    appendf(buf, size, len, ",\"rfTx\":%d,\"rfRx\":%d,\"rfNoise\":%d",
+            rfTxNum, rfRxNum, -(radios[0].sx->bgRssi>>5));
+    if (rfNum > 1) {
+        // per-radio counters
+        appendf(buf, size, len, ",\"radios\":[");
+        for (int i=0; i<rfNum; i++) {
+            Radio &r = radios[i];
+            appendf(buf, size, len, "%s{\"freq\":%u,\"tx\":%d,\"rx\":%d,\"noise\":%d}",
+                    i ? "," : "", r.freq, r.txNum, r.rxNum, -(r.sx->bgRssi>>5));
+        }
+        appendf(buf, size, len, "]");
+    }
+    appendf(buf, size, len,
             ",\"mqttTx\":%d,\"mqttRx\":%d,\"ping\":%d,\"queue\":%d",
-            mqttTxNum, mqttRxNum, mqPingMs, pktBuffer.size());
+            mqttTxNum, mqttRxNum, mqPingMs, pktQueue.size());
+    appendf(buf, size, len, ",\"qDrop\":%d", pktQueue.evictions);
+    appendf(buf, size, len,
+            ",\"backlog\":%d,\"drained\":%d,\"inFlight\":%d,\"inFlightMax\":%d",
+            pktQueue.due() + flashLog.pending, drainNum, pktQueue.inFlight(), inFlightMax);
+    appendf(buf, size, len,
+            ",\"logPending\":%d,\"logDrop\":%d,\"logCorrupt\":%d,\"logReplay\":%d",
+            flashLog.pending, flashLog.dropped, flashLog.corrupt,
+            flashLog.replayed);
+    appendf(buf, size, len,
+            ",\"pubs\":%d,\"batches\":%d,\"batchFill\":%d,\"batchLat\":%d",
+            pubNum, batchNum, batchNum ? batchPktNum/batchNum : 0,
+            batchPktNum ? batchLatSum/batchPktNum : 0);
+    appendf(buf, size, len, ",\"pool\":%d,\"poolMax\":%d,\"poolFail\":%d",
+            pktPool.inUse(), pktPool.highWater, pktPool.fails);
+    appendf(buf, size, len, ",\"ringMax\":%d,\"ringOvf\":%d",
+            rxRing.highWater, rxRing.overflows);
+    appendf(buf, size, len, ",\"capture\":%d,\"capDrop\":%d,\"replay\":%d",
+            captureNum, captureRing.overflows, replayNum);
+    appendf(buf, size, len, ",\"nodes\":%d,\"nodeEvict\":%d,\"gws\":%d,\"gwRepl\":%d",
+            nrw.registry.numNodes, nrw.registry.evictions, nrw.registry.numGW,
+            nrw.registry.gwReplaced);
+    appendf(buf, size, len, ",\"gossipTx\":%d,\"gossipRx\":%d",
+            nrw.gossipTx, nrw.gossipRx);
+    appendf(buf, size, len,
+            ",\"dedupHeld\":%d,\"dedupSupp\":%d,\"dedupTimeout\":%d,\"dedupFull\":%d",
+            dedup.holds, dedup.suppressed, dedup.timeouts, dedup.full);
+    appendf(buf, size, len, ",\"evlog\":%d,\"evlogDrop\":%d",
+            evlog.written, evlog.dropped);
+    appendf(buf, size, len, ",\"loop50\":%d,\"loop99\":%d,\"loopMax\":%d",
+            loopLatency.percentile(50), loopLatency.percentile(99), loopLatency.max);
+    // percentage of the time since the previous report that loop() slept
+    static uint64_t lastIdleUs = 0, lastReportUs = 0;
+    uint64_t nowUs = esp_timer_get_time();
+    int idle = (loopIdleUs - lastIdleUs) * 100 / (nowUs - lastReportUs);
+    lastIdleUs = loopIdleUs;
+    lastReportUs = nowUs;
+    appendf(buf, size, len,
+            ",\"idle\":%d,\"wake50\":%d,\"wake99\":%d,\"wakeMax\":%d",
+            idle, wakeLatency.percentile(50), wakeLatency.percentile(99), wakeLatency.max);
+#ifdef VBATT
+    appendf(buf, size, len, ",\"vBattUs\":%d", vBattUs);
+#endif
+    appendf(buf, size, len, ",\"ackColl\":%d,\"ackMiss\":%d",
+            nrw.registry.ackCollisions, nrw.registry.ackMissed);
+    appendf(buf, size, len,
+            ",\"acks\":%d,\"ackLat50\":%d,\"ackLat99\":%d,\"ackLatMax\":%d,\"ackLate\":%d",
+            ackLatency.n, ackLatency.percentile(50), ackLatency.percentile(99), ackLatency.max,
+            ackLate);
+#if PKT_TIMING
+    len += timingReport(buf+len, size-len);
+#endif
     buf[len++] = '}';
     buf[len] = 0;
 
@@ -326,9 +1292,197 @@ void report() {
     //printf("JSON: %s\n", buf);
 }
 
+//===== Metrics, see metrics.h
+
+// MetricsSnapshot is a copy of what /metrics exports, taken by loop() every metricsMs
+struct MetricsSnapshot {
+    uint32_t uptime, heap, heapBlock, heapMin, vBatt;
+    uint32_t memBytes[MEM_NUM], memLive[MEM_NUM];
+    int32_t wifiRssi;
+    // counters
+    uint32_t rfRx, rfTx, rfBad, mqttTx, mqttRx, pubs, rexmits, drained;
+    uint32_t qDrop, poolFail, ringOvf, ackLate, logDrop, logCorrupt, evlogDrop;
+    uint32_t dedupSupp, dedupTimeout;
+    uint32_t radioRx[RF_MAX_RADIOS], radioTx[RF_MAX_RADIOS];
+    // gauges
+    uint32_t queue, backlog, inFlight, pool, ring, nodes, gws;
+    int32_t noise[RF_MAX_RADIOS];
+    LogHistogram ackLat, loopLat, wakeLat;
+#if PKT_TIMING
+    LogHistogram pktLat;
+#endif
+};
+
+uint32_t metricsMs = 1000;
+DV(metricsMs);
+Seqlock<MetricsSnapshot> metrics;
+uint32_t metricsRetries = 0; // snapshot copies retried because loop() was updating it
+AsyncWebServer webServer(80);
+
+// metricsLoop publishes a new snapshot when one is due
+void metricsLoop() {
+    static uint32_t last = 0;
+    static MetricsSnapshot m;
+    uint32_t now = millis();
+    if (last != 0 && now - last < metricsMs) {
+        loopNext(last + metricsMs);
+        return;
+    }
+    last = now;
+    loopNext(now + metricsMs);
+
+    m.uptime = esp_timer_get_time()/1000000;
+    m.heap = ESP.getFreeHeap();
+    m.heapBlock = ESP.getMaxAllocHeap();
+    m.heapMin = ESP.getMinFreeHeap();
+    for (int i=0; i<MEM_NUM; i++) {
+        MemStats s = memAcct.get(i);
+        m.memBytes[i] = s.bytes;
+        m.memLive[i] = s.live;
+    }
+    m.vBatt = vBatt;
+    m.wifiRssi = WiFi.RSSI();
+    m.rfRx = rfRxNum;
+    m.rfTx = rfTxNum;
+    m.rfBad = rfBadNum;
+    m.mqttTx = mqttTxNum;
+    m.mqttRx = mqttRxNum;
+    m.pubs = pubNum;
+    m.rexmits = rexmitNum;
+    m.drained = drainNum;
+    m.qDrop = pktQueue.evictions;
+    m.poolFail = pktPool.fails;
+    m.ringOvf = rxRing.overflows;
+    m.ackLate = ackLate;
+    m.logDrop = flashLog.dropped;
+    m.logCorrupt = flashLog.corrupt;
+    m.evlogDrop = evlog.dropped;
+    m.dedupSupp = dedup.suppressed;
+    m.dedupTimeout = dedup.timeouts;
+    for (int i=0; i<rfNum; i++) {
+        m.radioRx[i] = radios[i].rxNum;
+        m.radioTx[i] = radios[i].txNum;
+        m.noise[i] = -(radios[i].sx->bgRssi>>5);
+    }
+    m.queue = pktQueue.size();
+    m.backlog = pktQueue.due() + flashLog.pending;
+    m.inFlight = pktQueue.inFlight();
+    m.pool = pktPool.inUse();
+    m.ring = rxRing.count();
+    m.nodes = nrw.registry.numNodes;
+    m.gws = nrw.registry.numGW;
+    // the radio task may record into ackLatency during the copy, which can make the copy's
+    // count off by one, that's fine for metrics
+    m.ackLat = ackLatency;
+    m.loopLat = loopLatency;
+    m.wakeLat = wakeLatency;
+#if PKT_TIMING
+    m.pktLat = pktTiming.total;
+#endif
+    metrics.write(m);
+}
+
+// metricsHandler serves /metrics, it runs in the web server's task
+void metricsHandler(AsyncWebServerRequest *req) {
+    MemScope mem(MEM_WEB);
+    static MetricsSnapshot m; // requests are handled one at a time
+    metricsRetries += metrics.read(m);
+    AsyncResponseStream *out = req->beginResponseStream("text/plain; version=0.0.4");
+
+    promMetric(out, "uptime_seconds", "gauge", "Time since boot");
+    promValue(out, "uptime_seconds", m.uptime);
+    promMetric(out, "heap_free_bytes", "gauge", "Free heap");
+    promValue(out, "heap_free_bytes", m.heap);
+    promMetric(out, "heap_largest_block_bytes", "gauge", "Largest free heap block");
+    promValue(out, "heap_largest_block_bytes", m.heapBlock);
+    promMetric(out, "heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+    promValue(out, "heap_min_free_bytes", m.heapMin);
+#if MEMACCT
+    promMetric(out, "mem_bytes", "gauge", "Heap bytes allocated per subsystem");
+    for (int i=0; i<MEM_NUM; i++) promValue(out, "mem_bytes", m.memBytes[i], "subsys", memTagName[i]);
+    promMetric(out, "mem_allocations", "gauge", "Live heap allocations per subsystem");
+    for (int i=0; i<MEM_NUM; i++) promValue(out, "mem_allocations", m.memLive[i], "subsys", memTagName[i]);
+#endif
+    promMetric(out, "battery_millivolts", "gauge", "Battery voltage");
+    promValue(out, "battery_millivolts", m.vBatt);
+    promMetric(out, "wifi_rssi_dbm", "gauge", "Wifi signal strength");
+    promSigned(out, "wifi_rssi_dbm", m.wifiRssi);
+
+    promMetric(out, "rf_rx_total", "counter", "Packets received by the radios");
+    promValue(out, "rf_rx_total", m.rfRx);
+    promMetric(out, "rf_tx_total", "counter", "ACKs sent by the radios");
+    promValue(out, "rf_tx_total", m.rfTx);
+    promMetric(out, "rf_decode_failures_total", "counter", "Packets that could not be decoded");
+    promValue(out, "rf_decode_failures_total", m.rfBad);
+    if (rfNum > 1) {
+        promMetric(out, "radio_rx_total", "counter", "Packets received per radio");
+        for (int i=0; i<rfNum; i++) promValue(out, "radio_rx_total", m.radioRx[i], "radio", i);
+        promMetric(out, "radio_tx_total", "counter", "ACKs sent per radio");
+        for (int i=0; i<rfNum; i++) promValue(out, "radio_tx_total", m.radioTx[i], "radio", i);
+    }
+    promMetric(out, "rf_noise_dbm", "gauge", "Background RSSI per radio");
+    for (int i=0; i<rfNum; i++) promSigned(out, "rf_noise_dbm", m.noise[i], "radio", i);
+
+    promMetric(out, "mqtt_tx_total", "counter", "MQTT messages published");
+    promValue(out, "mqtt_tx_total", m.mqttTx);
+    promMetric(out, "mqtt_rx_total", "counter", "MQTT messages received");
+    promValue(out, "mqtt_rx_total", m.mqttRx);
+    promMetric(out, "publishes_total", "counter", "Packet publishes, single or batched");
+    promValue(out, "publishes_total", m.pubs);
+    promMetric(out, "retransmits_total", "counter", "Packets republished for lack of a PUBACK");
+    promValue(out, "retransmits_total", m.rexmits);
+    promMetric(out, "drained_total", "counter", "Packets published from the backlog");
+    promValue(out, "drained_total", m.drained);
+
+    promMetric(out, "queue_drops_total", "counter", "Packets evicted from the full pktQueue");
+    promValue(out, "queue_drops_total", m.qDrop);
+    promMetric(out, "pool_failures_total", "counter", "Packets dropped for lack of a buffer");
+    promValue(out, "pool_failures_total", m.poolFail);
+    promMetric(out, "ring_overflows_total", "counter", "Packets dropped by the full rxRing");
+    promValue(out, "ring_overflows_total", m.ringOvf);
+    promMetric(out, "ack_late_total", "counter", "ACKs not sent because the deadline passed");
+    promValue(out, "ack_late_total", m.ackLate);
+    promMetric(out, "flash_log_drops_total", "counter", "Packets dropped by the full flash log");
+    promValue(out, "flash_log_drops_total", m.logDrop);
+    promMetric(out, "flash_log_corrupt_total", "counter", "Corrupt flash log records");
+    promValue(out, "flash_log_corrupt_total", m.logCorrupt);
+    promMetric(out, "evlog_drops_total", "counter", "Event log records dropped");
+    promValue(out, "evlog_drops_total", m.evlogDrop);
+    promMetric(out, "dedup_suppressed_total", "counter", "Packets published by another gateway");
+    promValue(out, "dedup_suppressed_total", m.dedupSupp);
+    promMetric(out, "dedup_timeouts_total", "counter", "Held packets published after a timeout");
+    promValue(out, "dedup_timeouts_total", m.dedupTimeout);
+
+    promMetric(out, "queue_packets", "gauge", "Packets in pktQueue");
+    promValue(out, "queue_packets", m.queue);
+    promMetric(out, "backlog_packets", "gauge", "Packets waiting to be published");
+    promValue(out, "backlog_packets", m.backlog);
+    promMetric(out, "in_flight_packets", "gauge", "Packets published and awaiting a PUBACK");
+    promValue(out, "in_flight_packets", m.inFlight);
+    promMetric(out, "pool_packets", "gauge", "Packet buffers in use");
+    promValue(out, "pool_packets", m.pool);
+    promMetric(out, "ring_packets", "gauge", "Packets in rxRing");
+    promValue(out, "ring_packets", m.ring);
+    promMetric(out, "nodes", "gauge", "Nodes in the registry");
+    promValue(out, "nodes", m.nodes);
+    promMetric(out, "gateways", "gauge", "Gateways in the registry");
+    promValue(out, "gateways", m.gws);
+
+    promHistogram(out, "ack_latency_seconds", "Packet end to ACK TX start", m.ackLat);
+    promHistogram(out, "loop_duration_seconds", "Duration of a loop() iteration", m.loopLat);
+    promHistogram(out, "wake_latency_seconds", "Wake-up to loop() running", m.wakeLat);
+#if PKT_TIMING
+    promHistogram(out, "packet_latency_seconds", "Packet RX to PUBACK", m.pktLat);
+#endif
+    promMetric(out, "metrics_retries_total", "counter", "Snapshot copies retried");
+    promValue(out, "metrics_retries_total", metricsRetries);
+    req->send(out);
+}
+
 //===== Setup
 
 void setup() {
+    memTagReady = true; // setup() runs in loopTask, see memacct.h
     Serial.begin(115200);
     printf("\n===== ESP32 RF Gateway =====\n");
     printf("Running ESP-IDF %s\n", ESP.getSdkVersion());
@@ -350,15 +1504,19 @@ void setup() {
     sntp_init();
 
     // radio init
-    printf("Initializing radio\n");
     spi.begin(RF_CLK, RF_MISO, RF_MOSI);
-    radio.init(rfId, rfGroup, rfFreq);
-    radio.setIntrPins(RF_DIO0, RF_DIO4);
-    radio.txPower(rfPow);
-    radio.setMode(SX1276fsk::MODE_STANDBY);
+    if (rfNum > (int)RF_MAX_RADIOS) rfNum = RF_MAX_RADIOS;
+    for (int i=0; i<rfNum; i++) {
+        radios[i].begin(spi, i, rfConfig[i], rfId, rfGroup, rfFreq, rfPow);
+        printf("Initialized radio %d: %uHz group %d\n", i, radios[i].freq, radios[i].group);
+    }
 
     nrw.setup();
-    printf("pktBuf size = %d\n", pktBuffer.size());
+    nrw.onPublished = onPeerPublished;
+    loopTask = xTaskGetCurrentTaskHandle(); // setup() and loop() run in the same task
+    printf("pktQueue size = %d\n", PacketQueue::CAP);
+    logSetup();
+    otaSetup();
 
     pinMode(LED_MQTT, OUTPUT); digitalWrite(LED_MQTT, LED_OFF);
     pinMode(LED_RF, OUTPUT); digitalWrite(LED_RF, LED_OFF);
@@ -366,10 +1524,18 @@ void setup() {
 
 #ifdef VBATT
     analogSetup(VBATT);
+    xTaskCreatePinnedToCore(vBattTask, "vbatt", 2048, 0, VBATT_TASK_PRIO, 0, RF_TASK_CORE);
 #endif
 
     delay(200);
 
+    // start receiving packets
+    xTaskCreatePinnedToCore(evlogTask, "evlog", 4096, 0, EVLOG_TASK_PRIO, 0, RF_TASK_CORE);
+    xTaskCreatePinnedToCore(rfTask, "rf", 4096, 0, RF_TASK_PRIO, 0, RF_TASK_CORE);
+
+    webServer.on("/metrics", HTTP_GET, metricsHandler);
+    webServer.begin();
+
     printf("===== Setup complete\n");
 }
 
@@ -378,6 +1544,8 @@ bool wifiConn = false;
 uint32_t lastReport = -50*1000;
 
 void loop() {
+    uint32_t loopStart = esp_timer_get_time();
+
     // print wifi/mqtt info every now and then
     bool conn = WiFi.isConnected();
     bool mqConn = mqttClient.connected();
@@ -400,13 +1568,17 @@ void loop() {
         if (mqttLed == 0) digitalWrite(LED_WIFI, (wifiConn && mqConn) ? LED_OFF : LED_ON);
     }
 
-#ifdef VBATT
-    uint32_t vB = 2 * analogSample(VBATT);
-    vB = vB * 4046/4096;
-    vBatt = (vBatt*15+vB)/16;
-#endif
-
-    rfLoop(mqConn);
+    // allocations are charged to the subsystem doing the work, see memacct.h
+    memTag = MEM_PKT;
+    rxLoop(mqConn);
+    dedupLoop(mqConn);
+    memTag = MEM_REG;
+    nrw.loop(gossipMs);
+    memTag = MEM_PKT;
+    captureLoop(mqConn);
+    logLoop(mqConn);
+    memTag = MEM_OTHER;
+    metricsLoop();
     if (mqConn && millis() - lastReport > 20*1000) {
         report();
         lastReport = millis();
@@ -422,9 +1594,30 @@ void loop() {
         rfLed = 0;
     }
 
+    memTag = MEM_MQTT;
     mqttLoop();
+    memTag = MEM_OTHER;
     cmd.loop();
+    memTag = MEM_PKT;
     packetLoop();
+    memTag = MEM_OTHER;
+
+    if (otaRebootAt && (int32_t)(millis() - otaRebootAt) >= 0) {
+        printf("OTA: rebooting into the new image\n");
+        otaRebootAt = 0;
+        ESP.restart();
+    }
+
+    // deadlines of the periodic work above
+    loopNext(lastInfo + 20000);
+    if (mqConn) loopNext(lastReport + 20*1000);
+    if (mqttLed != 0) loopNext(mqttLed + 200);
+    if (rfLed != 0) loopNext(rfLed + 200);
+    if (nrw.summary.count > 0) loopNext(nrw.summary.first + gossipMs);
+    if (dedup.numHeld > 0) loopNext(dedup.nextTimeout());
+    if (flashLog.bufferedAt()) loopNext(flashLog.bufferedAt() + logFlushMs);
+    if (otaRebootAt) loopNext(otaRebootAt);
+    loopLatency.record(esp_timer_get_time() - loopStart);
 
-    //delay(10);
+    loopSleep();
 }
@@ -0,0 +1,98 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Memory accounting: each C++ heap allocation (operator new, see main.cpp) is charged to the
+// subsystem whose code made it, which is given by a per-task tag set with MemScope. The
+// allocation carries a small header with its size and tag so that delete credits the same
+// subsystem, whichever task frees it. This shows which subsystem holds on to memory when the
+// free heap shrinks over weeks of uptime. C allocations (malloc by lwIP, WiFi or Arduino's
+// String) are not seen, they only show up in the heap totals.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+
+#ifndef MEMACCT
+#define MEMACCT 1
+#endif
+
+// MEM_TAGS lists the subsystems: ID and name used in the stats
+#define MEM_TAGS(X) \
+    X(MEM_OTHER, "other") \
+    X(MEM_RF,    "rf")    \
+    X(MEM_PKT,   "pkt")   \
+    X(MEM_MQTT,  "mqtt")  \
+    X(MEM_REG,   "reg")   \
+    X(MEM_WEB,   "web")   \
+    X(MEM_LOG,   "log")
+
+#define MEM_TAG_ID(id, name) id,
+enum { MEM_TAGS(MEM_TAG_ID) MEM_NUM };
+#undef MEM_TAG_ID
+#define MEM_TAG_NAME(id, name) name,
+static const char *const memTagName[MEM_NUM] = { MEM_TAGS(MEM_TAG_NAME) };
+#undef MEM_TAG_NAME
+
+struct MemStats {
+    uint32_t allocs;            // number of allocations
+    uint32_t live;              // allocations not freed yet
+    uint32_t bytes;             // bytes in use
+    uint32_t highWater;         // max bytes in use at any point in time
+};
+
+class MemAcct {
+public:
+    void alloc(int tag, uint32_t size) {
+        portENTER_CRITICAL(&mux);
+        MemStats &s = stats[tag];
+        s.allocs++;
+        s.live++;
+        s.bytes += size;
+        if (s.bytes > s.highWater) s.highWater = s.bytes;
+        portEXIT_CRITICAL(&mux);
+    }
+
+    void free(int tag, uint32_t size) {
+        portENTER_CRITICAL(&mux);
+        MemStats &s = stats[tag];
+        s.live--;
+        s.bytes -= size;
+        portEXIT_CRITICAL(&mux);
+    }
+
+    // get returns a consistent copy of the stats of a subsystem
+    MemStats get(int tag) {
+        portENTER_CRITICAL(&mux);
+        MemStats s = stats[tag];
+        portEXIT_CRITICAL(&mux);
+        return s;
+    }
+
+private:
+    MemStats stats[MEM_NUM] = {};
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
+
+extern MemAcct memAcct;
+extern thread_local uint8_t memTag; // subsystem charged for the running task's allocations
+// memTagReady is set by setup(). Static constructors run before the FreeRTOS scheduler starts,
+// when the thread-local storage that memTag lives in isn't set up yet, so their allocations must
+// not read memTag and are charged to MEM_OTHER. MemScope must not be used before setup() either.
+extern bool memTagReady;
+
+// MemScope charges the allocations made in a scope to a subsystem
+class MemScope {
+public:
+    MemScope(uint8_t tag) : prev(memTag) { memTag = tag; }
+    ~MemScope() { memTag = prev; }
+private:
+    uint8_t prev;
+};
+
+// MemHdr precedes each allocation, it keeps the allocation aligned like malloc does
+struct alignas(alignof(max_align_t)) MemHdr {
+    uint32_t size;
+    uint8_t tag;
+};
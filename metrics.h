@@ -0,0 +1,94 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Metrics in the Prometheus text format, served on http://<gateway>/metrics.
+// loop() periodically copies the counters, gauges and histograms into a snapshot protected by a
+// Seqlock, and the web server's task formats the latest snapshot when it gets scraped. Neither
+// side ever waits for the other: the writer doesn't take a lock and a reader that overlaps with
+// an update simply copies the snapshot again. The radio task is not involved at all.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "histogram.h"
+
+// Seqlock holds a value with a single writer and any number of readers. The sequence number is
+// odd while the writer updates the value, a reader retries if it changed during its copy.
+template <typename T>
+class Seqlock {
+public:
+    void write(const T &v) {
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s+1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy((void *)&value, (const void *)&v, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_release);
+        seq.store(s+2, std::memory_order_relaxed);
+    }
+
+    // read copies the value, it returns the number of retries. If the writer is in the middle of
+    // an update the reader sleeps a tick: it may have preempted the writer.
+    int read(T &v) {
+        for (int retries=0; ; retries++) {
+            uint32_t s = seq.load(std::memory_order_acquire);
+            if (s & 1) {
+                delay(1);
+                continue;
+            }
+            memcpy((void *)&v, (const void *)&value, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == s) return retries;
+        }
+    }
+
+    uint32_t version() { return seq.load(std::memory_order_acquire) >> 1; }
+
+private:
+    std::atomic<uint32_t> seq{0};
+    T value;
+};
+
+// PROM_BUCKETS is the number of histogram buckets exported, their bounds are powers of two
+// from 1us to 2^(PROM_BUCKETS-1)us, i.e. ~1s
+#define PROM_BUCKETS 21
+
+// promMetric writes the HELP and TYPE lines of a metric
+template <typename Out>
+void promMetric(Out *out, const char *name, const char *type, const char *help) {
+    out->printf("# HELP rfgw_%s %s\n# TYPE rfgw_%s %s\n", name, help, name, type);
+}
+
+// promValue writes a sample of a metric with an optional numeric or string label, promSigned one
+// that may be negative
+template <typename Out>
+void promValue(Out *out, const char *name, uint32_t value, const char *label = 0, int lv = 0) {
+    if (label) out->printf("rfgw_%s{%s=\"%d\"} %u\n", name, label, lv, value);
+    else out->printf("rfgw_%s %u\n", name, value);
+}
+template <typename Out>
+void promValue(Out *out, const char *name, uint32_t value, const char *label, const char *lv) {
+    out->printf("rfgw_%s{%s=\"%s\"} %u\n", name, label, lv, value);
+}
+template <typename Out>
+void promSigned(Out *out, const char *name, int32_t value, const char *label = 0, int lv = 0) {
+    if (label) out->printf("rfgw_%s{%s=\"%d\"} %d\n", name, label, lv, value);
+    else out->printf("rfgw_%s %d\n", name, value);
+}
+
+// promHistogram writes a LogHistogram of microseconds as a histogram in seconds. A bucket counts
+// the samples below its bound, which makes it off by 1us from Prometheus' "less or equal".
+template <typename Out>
+void promHistogram(Out *out, const char *name, const char *help, LogHistogram &h) {
+    promMetric(out, name, "histogram", help);
+    for (int i=0; i<PROM_BUCKETS; i++) {
+        uint32_t le = 1u << i;
+        out->printf("rfgw_%s_bucket{le=\"%u.%06u\"} %u\n", name, le/1000000, le%1000000,
+                h.countBelow(le));
+    }
+    out->printf("rfgw_%s_bucket{le=\"+Inf\"} %u\n", name, h.n);
+    out->printf("rfgw_%s_sum %u.%06u\n", name, (uint32_t)(h.sum/1000000),
+            (uint32_t)(h.sum%1000000));
+    out->printf("rfgw_%s_count %u\n", name, h.n);
+}
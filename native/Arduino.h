@@ -0,0 +1,57 @@
+// Host stand-in for the subset of the Arduino-ESP32 core used by the gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <chrono>
+#include <thread>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include "freertos.h"
+
+#define ARDUINO_BOARD "native"
+#define INPUT  0
+#define OUTPUT 1
+#define LOW    0
+#define HIGH   1
+
+// not static so all translation units share t0
+inline uint64_t esp_timer_get_time() {
+    using namespace std::chrono;
+    static const auto t0 = steady_clock::now();
+    return duration_cast<microseconds>(steady_clock::now() - t0).count();
+}
+static inline uint32_t micros() { return (uint32_t)esp_timer_get_time(); }
+static inline uint32_t millis() { return (uint32_t)(esp_timer_get_time()/1000); }
+static inline void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+static inline void delayMicroseconds(uint32_t us) {
+    uint64_t end = esp_timer_get_time() + us;
+    while (esp_timer_get_time() < end) ;
+}
+
+static inline void pinMode(int pin, int mode) { }
+static inline void digitalWrite(int pin, int val) { }
+static inline int digitalRead(int pin) { return 0; }
+
+class HardwareSerial {
+public:
+    void begin(int baud) { }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    uint32_t getFreeHeap() { return 200000; }
+    uint32_t getMaxAllocHeap() { return 110000; }
+    uint32_t getMinFreeHeap() { return 190000; }
+    void restart() { restarts++; }
+    uint32_t restarts = 0;
+    const char *getSdkVersion() { return "native"; }
+};
+extern EspClass ESP;
@@ -0,0 +1,54 @@
+// Host stand-in for ESPAsyncWebServer, requests are made by calling get()
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string>
+#include <map>
+#include <functional>
+
+#define HTTP_GET 1
+
+class AsyncResponseStream {
+public:
+    size_t printf(const char *fmt, ...) {
+        char buf[256];
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        body.append(buf, n < (int)sizeof(buf) ? n : sizeof(buf)-1);
+        return n;
+    }
+    std::string contentType, body;
+};
+
+class AsyncWebServerRequest {
+public:
+    AsyncResponseStream *beginResponseStream(const char *type) {
+        resp.contentType = type;
+        return &resp;
+    }
+    void send(AsyncResponseStream *r) { sent = true; }
+    AsyncResponseStream resp;
+    bool sent = false;
+};
+
+class AsyncWebServer {
+public:
+    typedef std::function<void(AsyncWebServerRequest *)> Handler;
+    AsyncWebServer(int port) { }
+    void on(const char *uri, int method, Handler h) { handlers[uri] = h; }
+    void begin() { }
+
+    // get runs the handler of a URI and returns the response body
+    std::string get(const char *uri) {
+        AsyncWebServerRequest req;
+        auto h = handlers.find(uri);
+        if (h != handlers.end()) h->second(&req);
+        return req.sent ? req.resp.body : "";
+    }
+
+private:
+    std::map<std::string, Handler> handlers;
+};
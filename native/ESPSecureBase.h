@@ -0,0 +1,164 @@
+// Host stand-in for esp32-secure-base: config, CLI, OTA and an in-memory MQTT client that
+// records publishes and delivers PUBACKs after a configurable delay with configurable loss.
+// Like a broker it echoes publishes on subscribed topics back to the message callbacks.
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include "Arduino.h"
+
+#define DV(v) extern int dv_unused_##v
+
+struct MqttProps { uint8_t qos; bool dup, retain; };
+
+class AsyncMqttClient {
+public:
+    typedef std::function<void(bool)> ConnectCB;
+    typedef std::function<void(char*, char*, MqttProps, size_t, size_t, size_t)> MessageCB;
+    typedef std::function<void(uint16_t)> PublishCB;
+
+    void onConnect(ConnectCB cb) { connectCBs.push_back(cb); }
+    void onMessage(MessageCB cb) { messageCBs.push_back(cb); }
+    void onPublish(PublishCB cb) { publishCBs.push_back(cb); }
+    bool connected() { return isConnected; }
+    uint16_t subscribe(const char *topic, int qos) {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto &t : subs) if (t == topic) return nextId();
+        subs.push_back(topic);
+        return nextId();
+    }
+
+    uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload,
+            size_t len=0, bool dup=false)
+    {
+        if (!isConnected) return 0;
+        if (len == 0 && payload) len = strlen(payload);
+        std::lock_guard<std::mutex> lk(mtx);
+        uint16_t id = qos > 0 ? nextId() : 0;
+        pubNum++;
+        pubBytes += len;
+        if (record) pubs.push_back(Pub{topic, std::string(payload, len), id, micros()});
+        if (onPub) onPub(topic, payload, len, id, dup);
+        if (id && (lossPct == 0 || rand()%100 >= lossPct))
+            acks.push_back(Ack{id, millis() + ackDelayMs});
+        for (auto &t : subs)
+            if (t == topic) echoes.push_back(Pub{topic, std::string(payload, len), id, millis()});
+        return id;
+    }
+
+    // connect/disconnect simulate broker connection changes
+    void connect() {
+        isConnected = true;
+        for (auto &cb : connectCBs) cb(false);
+    }
+    void disconnect() {
+        isConnected = false;
+        std::lock_guard<std::mutex> lk(mtx);
+        acks.clear();
+        subs.clear();
+    }
+
+    // deliver injects a message as if received from the broker, frag > 0 hands it over in
+    // fragments of that size like AsyncMqttClient does with a message spanning TCP segments
+    void deliver(const char *topic, const char *payload, size_t len, size_t frag = 0) {
+        std::vector<char> t(topic, topic+strlen(topic)+1);
+        if (frag == 0) frag = len;
+        size_t index = 0;
+        do {
+            size_t n = len-index < frag ? len-index : frag;
+            std::vector<char> p(payload+index, payload+index+n);
+            p.push_back(0);
+            for (auto &cb : messageCBs)
+                cb(t.data(), p.data(), MqttProps{1, false, false}, n, index, len);
+            index += n;
+        } while (index < len);
+    }
+
+    // loop delivers PUBACKs that are due and echoes publishes on subscribed topics
+    void loop() {
+        uint32_t now = millis();
+        std::vector<uint16_t> due;
+        std::vector<Pub> msgs;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            while (!acks.empty() && (int32_t)(now - acks.front().at) >= 0) {
+                due.push_back(acks.front().id);
+                acks.pop_front();
+            }
+            while (!echoes.empty() && (int32_t)(now - echoes.front().at) >= (int32_t)echoDelayMs) {
+                msgs.push_back(echoes.front());
+                echoes.pop_front();
+            }
+        }
+        for (uint16_t id : due) for (auto &cb : publishCBs) cb(id);
+        uint64_t t0 = esp_timer_get_time();
+        for (auto &m : msgs) deliver(m.topic.c_str(), m.payload.data(), m.payload.size());
+        echoUs += esp_timer_get_time() - t0;
+    }
+
+    struct Pub { std::string topic, payload; uint16_t id; uint32_t at; };
+    std::vector<Pub> pubs;
+    bool record = false;
+    std::function<void(const char *, const char *, size_t, uint16_t, bool)> onPub; // publish hook
+    uint32_t ackDelayMs = 5;
+    uint32_t echoDelayMs = 0;
+    int lossPct = 0;
+    uint32_t pubNum = 0, pubBytes = 0;
+    uint64_t echoUs = 0; // time spent delivering echoed messages
+
+private:
+    struct Ack { uint16_t id; uint32_t at; };
+    uint16_t nextId() { if (++lastId == 0) lastId = 1; return lastId; }
+    std::vector<ConnectCB> connectCBs;
+    std::vector<MessageCB> messageCBs;
+    std::vector<PublishCB> publishCBs;
+    std::deque<Ack> acks;
+    std::vector<std::string> subs;
+    std::deque<Pub> echoes;
+    std::mutex mtx;
+    uint16_t lastId = 0;
+    bool isConnected = false;
+};
+
+extern AsyncMqttClient mqttClient;
+extern char mqTopic[];
+extern int mqTopicLen;
+extern uint32_t mqPingMs;
+
+struct ESBConfig {
+    char mqtt_server[64] = "native";
+    void read() { }
+};
+
+class CommandParser {
+public:
+    CommandParser(void *stream) { }
+};
+
+class ESBCLI {
+public:
+    ESBCLI(ESBConfig &config, CommandParser &cp) { }
+    void init() { }
+    void loop() { }
+};
+
+class ESBDebug {
+public:
+    ESBDebug(CommandParser &cp) { }
+};
+
+class ESBOTA {
+public:
+    static void begin(const char *payload, size_t len) { }
+};
+
+static inline void mqttSetup(ESBConfig &config) { }
+// the native driver runs mqttClient.loop() in its own thread, like AsyncTCP's task on the ESP32
+static inline void mqttLoop() { }
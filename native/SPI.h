@@ -0,0 +1,30 @@
+// Host stand-in for the Arduino SPI class, the bytes of the current transaction are kept so the
+// fake radio can see what was written to its FIFO and the clock divider of the last transaction
+// is kept like the ESP32's SPIClass does
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+// the ESP32's APB clock divided by an integer, the real divider register has more fields
+static inline uint32_t spiFrequencyToClockDiv(uint32_t hz) { return hz ? 80000000/hz : 0; }
+static inline uint32_t spiClockDivToFrequency(uint32_t div) { return div ? 80000000/div : 0; }
+
+struct SPISettings {
+    SPISettings(uint32_t hz, int order, int mode) : hz(hz) { }
+    uint32_t hz;
+};
+
+class SPIClass {
+public:
+    void begin(int clk, int miso, int mosi) { }
+    void beginTransaction(SPISettings s) { div = spiFrequencyToClockDiv(s.hz); written.clear(); }
+    void endTransaction() { }
+    uint8_t transfer(uint8_t b) { written.push_back(b); return 0; }
+    uint32_t getClockDivider() { return div; }
+    std::vector<uint8_t> written;
+    uint32_t div = 0;
+};
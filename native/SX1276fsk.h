@@ -0,0 +1,135 @@
+// Host stand-in for the SX1276 FSK driver: frames are injected by the test driver and
+// handed out by receive(), sent frames are counted.
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include "Arduino.h"
+#include "SPI.h"
+
+// decodeVarint decodes one JeeLabs varint (zigzag, 7-bit groups MSB first, last byte has the
+// top bit set) and returns the number of bytes consumed, or 0 if incomplete.
+static inline int decodeVarint(const uint8_t *buf, int len, int32_t *out) {
+    uint32_t v = 0;
+    for (int i=0; i<len; i++) {
+        v = (v << 7) | (buf[i] & 0x7f);
+        if (buf[i] & 0x80) {
+            *out = (int32_t)((v >> 1) ^ -(v & 1));
+            return i+1;
+        }
+    }
+    return 0;
+}
+
+// decodeVarints decodes up to max values and returns the count, or -1 if the buffer holds more
+// than max values or ends with an incomplete value.
+static inline int decodeVarints(const uint8_t *buf, int len, int32_t *out, int max) {
+    int n = 0;
+    while (len > 0) {
+        if (n >= max) return -1;
+        int l = decodeVarint(buf, len, out+n);
+        if (l == 0) return -1;
+        buf += l; len -= l; n++;
+    }
+    return n;
+}
+
+class SX1276fsk {
+public:
+    enum { MODE_SLEEP, MODE_STANDBY, MODE_FSTX, MODE_TRANSMIT, MODE_FSRX, MODE_RECEIVE };
+
+    struct Frame {
+        uint8_t buf[80];
+        int len;
+        struct timeval at;
+        uint8_t rssi, margin;
+        int16_t afc;
+        uint64_t injectedUs;    // esp_timer_get_time() at injection
+    };
+
+    SX1276fsk(SPIClass &spi, int ss, int reset) : spi(spi) { }
+    // init accesses the chip over SPI like the real driver does, with an arbitrary clock
+    void init(uint8_t id, uint8_t group, uint32_t freq) {
+        this->group = group;
+        this->freq = freq;
+        spi.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0));
+        spi.endTransaction();
+        spiDiv = spi.getClockDivider();
+    }
+    void setIntrPins(int dio0, int dio4) { }
+    void txPower(int pow) { }
+    // setMode(MODE_TRANSMIT) sends the frame last written to the FIFO over SPI, see Radio::sendRaw,
+    // a frame written with another clock than the driver's is garbage and isn't sent
+    void setMode(int mode) {
+        std::vector<uint8_t> &w = spi.written;
+        if (mode != MODE_TRANSMIT || w.size() < 3 || w[0] != 0x80) return;
+        if (spi.getClockDivider() != spiDiv) { w.clear(); return; }
+        txNum++;
+        if (onSend) onSend(w[2], w.data()+3, w[1]-1);
+        w.clear();
+    }
+
+    int receive(uint8_t *buf, int len) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (rxq.empty()) return -1;
+        Frame &f = rxq.front();
+        int l = f.len < len ? f.len : len;
+        memcpy(buf, f.buf, l);
+        rxAt = f.at;
+        rssi = f.rssi;
+        margin = f.margin;
+        afc = f.afc;
+        if (onReceive) onReceive(f);
+        rxq.pop_front();
+        return l;
+    }
+
+    bool send(uint8_t header, const uint8_t *buf, int len) {
+        txNum++;
+        if (onSend) onSend(header, buf, len);
+        return true;
+    }
+
+    // inject queues a frame for reception, the arrival timestamp is set to the current time
+    void inject(const uint8_t *buf, int len, uint8_t rssi=120, uint8_t margin=20, int16_t afc=0) {
+        struct timeval at;
+        gettimeofday(&at, 0);
+        inject(buf, len, at, rssi, margin, afc);
+    }
+    void inject(const uint8_t *buf, int len, struct timeval at, uint8_t rssi, uint8_t margin,
+            int16_t afc)
+    {
+        Frame f;
+        memcpy(f.buf, buf, len < (int)sizeof(f.buf) ? len : sizeof(f.buf));
+        f.len = len;
+        f.at = at;
+        f.injectedUs = esp_timer_get_time();
+        f.rssi = rssi; f.margin = margin; f.afc = afc;
+        std::lock_guard<std::mutex> lk(mtx);
+        rxq.push_back(f);
+    }
+    int pending() { std::lock_guard<std::mutex> lk(mtx); return rxq.size(); }
+
+    struct timeval rxAt = {0, 0};
+    uint8_t rssi = 0, margin = 0;
+    int16_t afc = 0;
+    int32_t bgRssi = 200<<5;
+    uint8_t group = 0;
+    uint32_t freq = 0;
+    uint32_t txNum = 0;
+    std::function<void(const Frame &)> onReceive; // receive hook, called from the radio task
+    std::function<void(uint8_t, const uint8_t *, int)> onSend; // transmit hook
+
+private:
+    SPIClass &spi;
+    uint32_t spiDiv = 0;        // clock divider the driver configured
+    std::mutex mtx;
+    std::deque<Frame> rxq;
+};
@@ -0,0 +1,23 @@
+// Host stand-in for the Arduino-ESP32 WiFi class, always connected
+#pragma once
+
+#include <string>
+
+class IPAddress {
+public:
+    operator uint32_t() const { return 0x0101a8c0; }
+    std::string toString() const { return "192.168.1.1"; }
+};
+
+class WiFiClass {
+public:
+    bool isConnected() { return true; }
+    std::string SSID() { return "native"; }
+    IPAddress localIP() { return IPAddress(); }
+    IPAddress gatewayIP() { return IPAddress(); }
+    int RSSI() { return -50; }
+    void mode(int m) { }
+    void begin() { }
+};
+#define WIFI_STA 1
+extern WiFiClass WiFi;
@@ -0,0 +1,938 @@
+// ESP32 FSK Radio to MQTT gateway - host build
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Checks and micro-benchmarks of the gateway's building blocks, run with -T name, see
+// native.cpp. Each check prints its results and returns the number of failures.
+
+#include <Arduino.h>
+#include <SX1276fsk.h>
+#include <ESPSecureBase.h>
+#include <libb64/cencode.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <map>
+#include "../formats.h"
+#include "../pool.h"
+#include "../ring.h"
+#include "../pktqueue.h"
+#include "../cborwriter.h"
+#include "../registry.h"
+#include "../varint.h"
+#include "../flashlog.h"
+#include "../dedup.h"
+#include "../memacct.h"
+#include <set>
+#include <sys/mman.h>
+
+// aborts runs f in a child process and returns whether it died of SIGABRT, e.g. a failed assert
+static bool aborts(void (*f)()) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        f();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+#define CHECK(cond) do { if (!(cond)) { printf("  failed: %s (line %d)\n", #cond, __LINE__); bad++; } } while (0)
+
+//===== Slab pool
+
+typedef SlabPool<jlPacket, sizeof(jlPacket)+JL_MAX_PKT, 8> SmallPool;
+static SmallPool smallPool;
+static jlPacket foreignPkt;
+
+static void poolDoubleFree() {
+    jlPacket *p = smallPool.alloc();
+    smallPool.free(p);
+    smallPool.free(p);
+}
+
+static void poolForeignFree() { smallPool.free(&foreignPkt); }
+
+// poolCheck exercises alloc/free, exhaustion and refill of a SlabPool, checks that a double free
+// or a foreign pointer trips the guard, hammers the pool from several threads and times alloc/free
+// next to calloc/free. The timings are for reference only: the pool exists to bound packet memory
+// and keep it off the heap so the heap doesn't fragment, and the host's malloc says nothing about
+// the ESP32's, runs vary between a pool twice as fast and one slower than calloc.
+static int poolCheck() {
+    int bad = 0;
+    SmallPool &p = smallPool;
+    jlPacket *pkts[8];
+    for (int round=0; round<2; round++) {
+        // exhaust the pool, slots must be distinct and zeroed even after being scribbled on
+        for (int i=0; i<8; i++) {
+            pkts[i] = p.alloc();
+            CHECK(pkts[i] != 0);
+            if (!pkts[i]) return bad;
+            for (int j=0; j<i; j++) CHECK(pkts[i] != pkts[j]);
+            const uint8_t *b = (const uint8_t *)pkts[i];
+            for (size_t j=0; j<sizeof(jlPacket)+JL_MAX_PKT; j++) CHECK(b[j] == 0);
+            memset(pkts[i], 0xa5, sizeof(jlPacket)+JL_MAX_PKT);
+        }
+        CHECK(p.inUse() == 8 && p.available() == 0);
+        CHECK(p.alloc() == 0);
+        CHECK(p.fails == (uint32_t)round+1);
+        // refill in a different order than the slots were handed out
+        for (int i=0; i<8; i+=2) p.free(pkts[i]);
+        for (int i=1; i<8; i+=2) p.free(pkts[i]);
+        CHECK(p.inUse() == 0 && p.available() == 8);
+    }
+    p.free(0);
+    CHECK(p.allocs == 16 && p.highWater == 8 && p.badFrees == 0);
+    CHECK(aborts(poolDoubleFree));
+    CHECK(aborts(poolForeignFree));
+    printf("Pool: alloc/free, exhaustion, refill and free guard checked\n");
+
+    // several threads allocating and freeing, each slot is stamped by its owner while held
+    static PacketPool pool;
+    const int THREADS = 4, ITER = 200000;
+    std::atomic<int> conflicts(0);
+    std::vector<std::thread> threads;
+    for (int t=0; t<THREADS; t++) {
+        threads.emplace_back([t, &conflicts]() {
+            jlPacket *held[PKT_POOL_SIZE/THREADS] = {};
+            for (int i=0; i<ITER; i++) {
+                int k = (i*7 + t) % (PKT_POOL_SIZE/THREADS);
+                if (held[k]) {
+                    if (held[k]->node != (uint32_t)(t+1)*ITER + k) conflicts++;
+                    pool.free(held[k]);
+                    held[k] = 0;
+                } else if ((held[k] = pool.alloc()) != 0) {
+                    if (held[k]->node != 0) conflicts++;
+                    held[k]->node = (t+1)*ITER + k;
+                }
+            }
+            for (jlPacket *h : held) pool.free(h);
+        });
+    }
+    for (auto &t : threads) t.join();
+    CHECK(conflicts == 0);
+    CHECK(pool.inUse() == 0 && pool.fails == 0 && pool.badFrees == 0);
+    printf("Pool: %d threads x %d alloc/free, %d conflicts\n", THREADS, ITER, conflicts.load());
+
+    // alloc/free pairs with a working set of 32 packets held, as in the retransmit queue
+    const int N = 2000000, HELD = 32;
+    jlPacket *ring[HELD] = {};
+    uint64_t t0 = esp_timer_get_time();
+    for (int i=0; i<N; i++) {
+        jlPacket *&r = ring[i % HELD];
+        pool.free(r);
+        r = pool.alloc();
+        r->node = i;
+    }
+    for (jlPacket *&r : ring) { pool.free(r); r = 0; }
+    uint64_t t1 = esp_timer_get_time();
+    for (int i=0; i<N; i++) {
+        jlPacket *&r = ring[i % HELD];
+        free(r);
+        r = (jlPacket *)calloc(1, sizeof(jlPacket)+JL_MAX_PKT);
+        r->node = i;
+    }
+    for (jlPacket *&r : ring) free(r);
+    uint64_t t2 = esp_timer_get_time();
+    printf("Pool: alloc+free %.1fns, calloc+free %.1fns on this host (%d-byte slots)\n",
+            (t1-t0)*1000.0/N, (t2-t1)*1000.0/N, (int)(sizeof(jlPacket)+JL_MAX_PKT));
+    return bad;
+}
+
+//===== SPSC ring
+
+// RingItem spans several words so a torn copy shows up as a mismatch between seq and inv
+struct RingItem {
+    uint32_t seq;
+    uint32_t pad[6];
+    uint32_t inv;
+};
+
+// ringRun pushes n items through the ring from a producer thread to a consumer thread. With
+// retry the producer retries on a full ring, else it drops the item. The consumer checks that
+// items arrive intact, in order and at most once, it returns the number of bad items and sets
+// got to the number received.
+template <int SIZE>
+static int ringRun(SPSCRing<RingItem, SIZE> &r, uint32_t n, bool retry, uint32_t &got) {
+    std::atomic<bool> done(false);
+    std::thread producer([&]() {
+        for (uint32_t i=0; i<n; i++) {
+            RingItem it;
+            it.seq = i;
+            for (uint32_t &w : it.pad) w = i;
+            it.inv = ~i;
+            while (!r.push(it)) {
+                std::this_thread::yield();
+                if (!retry) break;
+            }
+            if (i % 1000 == 0) std::this_thread::yield(); // vary the interleaving
+        }
+        done = true;
+    });
+    int bad = 0;
+    uint32_t next = 0;
+    got = 0;
+    RingItem it;
+    for (;;) {
+        bool last = done;
+        if (!r.pop(it)) {
+            if (last) break;
+            std::this_thread::yield();
+            continue;
+        }
+        bool ok = it.inv == ~it.seq && it.seq >= next && (retry ? it.seq == next : true);
+        for (uint32_t w : it.pad) if (w != it.seq) ok = false;
+        if (!ok && bad++ < 10) printf("  ring: got item %u expecting %u\n", it.seq, next);
+        next = it.seq + 1;
+        got++;
+        if (got % 777 == 0) std::this_thread::yield();
+    }
+    producer.join();
+    return bad;
+}
+
+// ringCheck runs a producer and a consumer thread through a small ring for millions of laps,
+// once with the producer retrying when the ring is full, when every item must arrive in order,
+// and once with the producer dropping items like the radio task does, when the items that make
+// it must be in order and account for all the others as overflows
+static int ringCheck() {
+    int bad = 0;
+    const uint32_t N = 2000000;
+    uint32_t got;
+    static SPSCRing<RingItem, 8> r1;
+    uint64_t t0 = esp_timer_get_time();
+    int b = ringRun(r1, N, true, got);
+    uint64_t t1 = esp_timer_get_time();
+    CHECK(b == 0);
+    CHECK(got == N && r1.count() == 0);
+    printf("Ring: %u items through 8 slots with retry, %u received, %d bad, %u full, %.1fM items/s\n",
+            N, got, b, r1.overflows, N/(double)(t1-t0));
+    static SPSCRing<RingItem, 8> r2;
+    b = ringRun(r2, N, false, got);
+    CHECK(b == 0);
+    CHECK(got + r2.overflows == N && r2.count() == 0);
+    printf("Ring: %u items through 8 slots dropping when full, %u received, %u dropped, %d bad\n",
+            N, got, r2.overflows, b);
+    return bad;
+}
+
+//===== Packet queue
+
+#define QUEUE_REXMIT_MS 1100 // REXMIT_MS in main.cpp
+
+// MapQueue is the std::map that held the packets waiting for their PUBACK before PacketQueue,
+// packetLoop() scanned all of it on every call to find the packets to retransmit
+struct MapQueue {
+    std::map<uint16_t, jlPacket*> buf;
+    void publish(jlPacket *pkt, uint16_t id) { buf[id] = pkt; }
+    void acked(uint16_t id) {
+        auto it = buf.find(id);
+        if (it != buf.end()) buf.erase(it);
+    }
+    template <typename F> void due(uint32_t now, F rexmit) {
+        for (auto it=buf.begin(); it!=buf.end(); ) {
+            jlPacket *pkt = it->second;
+            if (now - pkt->mqAt > QUEUE_REXMIT_MS) {
+                buf.erase(it++);
+                buf[rexmit(pkt)] = pkt;
+            } else it++;
+        }
+    }
+    int size() { return buf.size(); }
+};
+
+// WheelQueue drives PacketQueue the way main.cpp does
+struct WheelQueue {
+    PacketQueue q;
+    void publish(jlPacket *pkt, uint16_t id) { q.push(pkt, id, pkt->mqAt + QUEUE_REXMIT_MS+1); }
+    void acked(uint16_t id) { q.remove(id); }
+    template <typename F> void due(uint32_t now, F rexmit) {
+        int s;
+        while ((s = q.nextDue(now)) >= 0) q.update(s, rexmit(q.packet(s)), now + QUEUE_REXMIT_MS+1);
+    }
+    int size() { return q.size(); }
+};
+
+struct QueueStats {
+    uint32_t pubs, rexmits;
+    int maxSize;
+    uint64_t us;
+};
+
+// queueSim publishes a packet per simulated millisecond for ticks ms and then waits for the
+// queue to drain. PUBACKs come back after ackDelay ms, pct percent of them are lost, which is
+// decided by hashing the packet and the attempt so both queues lose the same PUBACKs.
+template <typename Q>
+static QueueStats queueSim(Q &q, int ticks, int ackDelay, int lossPct) {
+    std::vector<jlPacket> pkts(ticks);
+    std::deque<std::pair<uint32_t, uint16_t>> acks; // PUBACKs to deliver: time, message id
+    QueueStats st = {};
+    uint16_t nextId = 1;
+    uint32_t now = 0;
+    auto publish = [&](jlPacket *p) -> uint16_t {
+        uint16_t id = nextId++;
+        if (nextId == 0) nextId = 1;
+        p->mqAt = now;
+        if (((p->node*2654435769u) ^ (p->fmt*40503u)) % 100 >= (uint32_t)lossPct)
+            acks.push_back(std::make_pair(now+ackDelay, id));
+        p->fmt++; // attempt
+        st.pubs++;
+        return id;
+    };
+    uint64_t t0 = esp_timer_get_time();
+    for (now=0; now<(uint32_t)ticks || q.size() > 0; now++) {
+        if (now < (uint32_t)ticks) {
+            jlPacket *p = &pkts[now];
+            p->node = now+1;
+            q.publish(p, publish(p));
+        }
+        while (!acks.empty() && acks.front().first <= now) {
+            q.acked(acks.front().second);
+            acks.pop_front();
+        }
+        q.due(now, [&](jlPacket *p) { st.rexmits++; return publish(p); });
+        if (q.size() > st.maxSize) st.maxSize = q.size();
+    }
+    st.us = esp_timer_get_time() - t0;
+    return st;
+}
+
+// queueCheck runs the same traffic through the old std::map scan and PacketQueue, checks that
+// both retransmit the same number of packets and compares their run time per simulated ms
+static int queueCheck() {
+    int bad = 0;
+    const int TICKS = 200000;
+    const int delays[] = { 5, 30, 60 };
+    for (int d : delays) {
+        MapQueue mq;
+        WheelQueue wq;
+        QueueStats m = queueSim(mq, TICKS, d, 2);
+        QueueStats w = queueSim(wq, TICKS, d, 2);
+        CHECK(m.pubs == w.pubs && m.rexmits == w.rexmits);
+        CHECK(wq.q.evictions == 0 && wq.q.size() == 0);
+        printf("Queue: PUBACK after %2dms, 2%% lost, up to %3d queued, %u rexmits: "
+                "map %.0fns/ms, PacketQueue %.0fns/ms\n", d, w.maxSize, w.rexmits,
+                m.us*1000.0/TICKS, w.us*1000.0/TICKS);
+        if (m.rexmits != w.rexmits) printf("  map rexmits %u, PacketQueue rexmits %u\n",
+                m.rexmits, w.rexmits);
+    }
+    return bad;
+}
+
+//===== JSON writer
+
+// randomPacket fills pkt with random metadata and a random payload of up to JL_MAX_PKT bytes,
+// some of which don't decode as varints
+static void randomPacket(jlPacket *pkt) {
+    memset(pkt, 0, sizeof(jlPacket)+JL_MAX_PKT);
+    pkt->at.tv_sec = 1500000000 + (rand()%4 == 0 ? rand() : rand()%3);
+    pkt->at.tv_usec = rand() % 1000000;
+    pkt->node = rand() * (rand()%2 ? 1 : 7);
+    pkt->rssi = rand();
+    pkt->snr = rand();
+    pkt->fei = rand();
+    pkt->fmt = rand() & 0x7f;
+    pkt->remMargin = rand();
+    pkt->remFEI = rand();
+    int len = pkt->dataLen = rand() % (JL_MAX_PKT+1);
+    uint8_t *data = (uint8_t *)pkt + offsetof(jlPacket, data);
+    for (int i=0; i<len; i++) data[i] = rand()%3 ? rand() | 0x80 : rand() & 0x7f;
+    if (len > 0 && rand()%2) data[len-1] |= 0x80;
+}
+
+// baselineRx is the baseline's sendPacket up to the point where it publishes, verbatim except
+// that it takes the gateway name as argument and returns the message. It is the reference for
+// encodeRxJson.
+static int baselineRx(jlPacket *pkt, const char *gw, char *out) {
+    char buf[512];
+    // rxAt is rx time in milliseconds since epoch (javascript timestamp)
+    //uint64_t rxAt = (uint64_t)(pkt->at.tv_sec)*1000 + (uint64_t)(pkt->at.tv_usec)/1000;
+    auto tm = gmtime(&pkt->at.tv_sec);
+    // json-encode all the metadata
+    int len = snprintf(buf, sizeof(buf),
+            "{\"at\":\"%d-%02d-%02dT%02d:%02d:%02d.%03ldZ\","
+             "\"gw\":\"%s\",\"hwid\":\"%x\",\"rssi\":%d,\"snr\":%d,\"fei\":%d,"
+             "\"type\":%d,\"remote_margin\":%d,\"remote_fei\":%d,"
+             "\"payload\":\"",
+             tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+             tm->tm_hour, tm->tm_min, tm->tm_sec, pkt->at.tv_usec/1000,
+             gw, pkt->node, pkt->rssi, pkt->snr, pkt->fei,
+             pkt->fmt, pkt->remMargin, pkt->remFEI);
+    if (len == sizeof(buf)) {
+        printf("OOPS: packet JSON too large\n");
+        return -1;
+    }
+    // add the payload as a base64 encoded string
+    if (pkt->dataLen > 0) {
+        int paylen = base64_encode_expected_len(pkt->dataLen);
+        if (len+paylen+2 >= sizeof(buf)) {
+            printf("OOPS: packet JSON too large: need %d\n", len+paylen+2);
+            return -1;
+        }
+        len += base64_encode_chars((char*)pkt->data, pkt->dataLen, buf+len);
+        buf[len++] = '"';
+    }
+    // add the varint-decoded payload as data array
+    if (pkt->dataLen > 0) {
+        int32_t data[20];
+        int c = decodeVarints(pkt->data, pkt->dataLen, data, 20);
+        if (c > 0) {
+            len += snprintf(buf+len, sizeof(buf)-len-2, ",\"data\":[");
+            for (int i=0; i<c; i++)
+                len += snprintf(buf+len, sizeof(buf)-len-2, "%d%c", data[i], i==c-1?']':',');
+        } else {
+            printf("Cannot decode varints: %d\n", c);
+        }
+    }
+    buf[len++] = '}';
+    buf[len  ] = 0;
+    memcpy(out, buf, len+1);
+    return len;
+}
+
+// jsonCheck compares encodeRxJson with the baseline's code byte for byte on random packets and
+// times both. The baseline drops the data array of payloads with more than 20 values, which
+// encodeRxJson includes since the varint decoder lost that limit, so for those packets the
+// array is removed before comparing, -V checks its content.
+static int jsonCheck() {
+    int bad = 0, long20 = 0;
+    const int N = 300000;
+    const char *gw = "rfgw/some-gateway";
+    static uint32_t mem[(sizeof(jlPacket)+JL_MAX_PKT+3)/4];
+    jlPacket *pkt = (jlPacket *)mem;
+    char buf[RX_JSON_MAX+1], ref[512];
+    FILE *out = stdout;
+    stdout = fopen("/dev/null", "w"); // the baseline prints payloads that aren't varints
+    srand(2);
+    for (int i=0; i<N; i++) {
+        randomPacket(pkt);
+        int len = encodeRxJson(pkt, gw, buf, RX_JSON_MAX);
+        int refLen = baselineRx(pkt, gw, ref);
+        if (len >= 0) buf[len] = 0;
+        if (len > 0 && varintCount(pkt->data, pkt->dataLen) > 20) {
+            char *d = strstr(buf, ",\"data\":[");
+            if (d) {
+                int n = buf+len - d - 1; // the array runs up to the final '}'
+                memmove(d, d+n, len - (d-buf) - n);
+                len -= n;
+                long20++;
+            }
+        }
+        if (len != refLen || memcmp(buf, ref, len) != 0) {
+            if (bad++ < 5) fprintf(out, "  mismatch:\n  %s\n  %.*s\n", ref, len < 0 ? 0 : len, buf);
+        }
+    }
+    fclose(stdout);
+    stdout = out;
+    printf("JSON: %d random packets, %d differ from the baseline code, %d with more than 20 values\n",
+            N, bad, long20);
+
+    // a typical packet: 12-byte payload of small varints
+    const uint8_t data[] = { 0x81, 0x02, 0x83, 0x0a, 0x90, 0x01, 0x7f, 0xff, 0x85, 0x86, 0x87, 0x88 };
+    memset(mem, 0, sizeof(mem));
+    pkt->at.tv_sec = 1700000000;
+    pkt->node = 0x1234abcd;
+    pkt->rssi = -90;
+    pkt->snr = 20;
+    pkt->dataLen = sizeof(data);
+    memcpy(pkt->data, data, sizeof(data));
+    const int ROUNDS = 200000;
+    volatile int sink = 0;
+    uint64_t t0 = esp_timer_get_time();
+    for (int i=0; i<ROUNDS; i++) {
+        pkt->at.tv_usec = i*7 % 1000000;
+        sink += baselineRx(pkt, gw, ref);
+    }
+    uint64_t t1 = esp_timer_get_time();
+    for (int i=0; i<ROUNDS; i++) {
+        pkt->at.tv_usec = i*7 % 1000000;
+        sink += encodeRxJson(pkt, gw, buf, sizeof(buf));
+    }
+    uint64_t t2 = esp_timer_get_time();
+    printf("JSON: baseline %.0fns/packet, encodeRxJson %.0fns/packet\n",
+            (t1-t0)*1000.0/ROUNDS, (t2-t1)*1000.0/ROUNDS);
+    return bad;
+}
+
+//===== CBOR writer
+
+// CborReader decodes the items written by CborWriter, independently of it. Integers that don't
+// use the shortest encoding, truncated items and indefinite lengths are errors.
+struct CborReader {
+    const uint8_t *p, *end;
+    bool err;
+
+    CborReader(const uint8_t *buf, int len) : p(buf), end(buf+len), err(false) { }
+
+    // head reads the initial bytes of an item, it returns the major type and sets v to the
+    // item's value or length
+    int head(uint64_t &v) {
+        v = 0;
+        if (err || p >= end) { err = true; return -1; }
+        uint8_t b = *p++;
+        int ai = b & 0x1f;
+        if (ai < 24) {
+            v = ai;
+            return b >> 5;
+        }
+        int n = ai == 24 ? 1 : ai == 25 ? 2 : ai == 26 ? 4 : ai == 27 ? 8 : 0;
+        if (n == 0 || end-p < n) { err = true; return -1; }
+        for (int i=0; i<n; i++) v = v<<8 | *p++;
+        if (v < (n == 1 ? 24 : 1ULL << (4*n))) err = true;
+        return b >> 5;
+    }
+
+    bool uint(uint64_t &v) { return head(v) == 0 && !err; }
+    bool sint(int64_t &v) {
+        uint64_t u;
+        int major = head(u);
+        if (major == 0) v = u;
+        else if (major == 1) v = -1 - (int64_t)u;
+        return (major == 0 || major == 1) && !err;
+    }
+    // string reads a byte (major 2) or text (major 3) string
+    bool string(int major, const uint8_t *&s, uint64_t &n) {
+        if (head(n) != major || err || (uint64_t)(end-p) < n) return err = true, false;
+        s = p;
+        p += n;
+        return true;
+    }
+    bool expect(int major, uint64_t n) {
+        uint64_t v;
+        return head(v) == major && v == n && !err;
+    }
+};
+
+// cborDecodeRx decodes an encodeRxCbor message and compares each field with the packet, it
+// returns the key of the first field that differs, 11 if the message doesn't end after the last
+// field, or -1 if everything matches
+static int cborDecodeRx(const uint8_t *buf, int len, jlPacket *pkt, const char *gw) {
+    int32_t ref[JL_MAX_PKT];
+    int c = pkt->dataLen > 0 ? decodeVarints(pkt->data, pkt->dataLen, ref, JL_MAX_PKT) : 0;
+    CborReader r(buf, len);
+    uint64_t u;
+    int64_t i;
+    const uint8_t *s;
+    if (!r.expect(5, c > 0 ? 11 : 10)) return 0;
+    if (!r.expect(0, 0) || !r.uint(u) || u != (uint64_t)pkt->at.tv_sec*1000 + pkt->at.tv_usec/1000)
+        return 0;
+    if (!r.expect(0, 1) || !r.string(3, s, u) || u != strlen(gw) || memcmp(s, gw, u) != 0) return 1;
+    if (!r.expect(0, 2) || !r.uint(u) || u != pkt->node) return 2;
+    if (!r.expect(0, 3) || !r.sint(i) || i != pkt->rssi) return 3;
+    if (!r.expect(0, 4) || !r.uint(u) || u != pkt->snr) return 4;
+    if (!r.expect(0, 5) || !r.sint(i) || i != pkt->fei) return 5;
+    if (!r.expect(0, 6) || !r.uint(u) || u != pkt->fmt) return 6;
+    if (!r.expect(0, 7) || !r.uint(u) || u != pkt->remMargin) return 7;
+    if (!r.expect(0, 8) || !r.sint(i) || i != pkt->remFEI) return 8;
+    if (!r.expect(0, 9) || !r.string(2, s, u) || u != pkt->dataLen || memcmp(s, pkt->data, u) != 0)
+        return 9;
+    if (c > 0) {
+        if (!r.expect(0, 10) || !r.expect(4, c)) return 10;
+        for (int j=0; j<c; j++) if (!r.sint(i) || i != ref[j]) return 10;
+    }
+    return r.p == r.end ? -1 : 11;
+}
+
+// cborCheck round-trips integers around each encoding boundary through CborWriter and
+// CborReader, then decodes encodeRxCbor messages for random packets and compares them field
+// by field with the packets and with the reference varint decoder
+static int cborCheck() {
+    int bad = 0;
+    uint8_t buf[RX_CBOR_MAX];
+    const int64_t edges[] = { 0, 23, 24, 255, 256, 65535, 65536, 0xffffffffLL, 0x100000000LL,
+            INT64_MAX };
+    int values = 0;
+    for (int64_t e : edges) {
+        for (int64_t v : { e, -e, -e-1 }) {
+            CborWriter w(buf, sizeof(buf));
+            w.sint(v);
+            CborReader r(buf, w.length());
+            int64_t got = 0;
+            if (!w.ok() || !r.sint(got) || got != v || r.p != r.end) {
+                if (bad++ < 5) printf("  integer %lld: got %lld\n", (long long)v, (long long)got);
+            }
+            values++;
+        }
+    }
+    CborWriter w(buf, 4);
+    w.text("too long");
+    CHECK(!w.ok());
+    printf("CBOR: %d integers round-tripped, overflow detected\n", values);
+
+    const int N = 300000;
+    const char *gw = "rfgw/some-gateway";
+    static uint32_t mem[(sizeof(jlPacket)+JL_MAX_PKT+3)/4];
+    jlPacket *pkt = (jlPacket *)mem;
+    int fields[12] = {};
+    srand(3);
+    for (int n=0; n<N; n++) {
+        randomPacket(pkt);
+        int len = encodeRxCbor(pkt, gw, buf, sizeof(buf));
+        int f = len < 0 ? 11 : cborDecodeRx(buf, len, pkt, gw);
+        if (f >= 0) {
+            fields[f]++;
+            if (bad++ < 5) printf("  node %x: field %d differs, %d bytes\n", pkt->node, f, len);
+        }
+    }
+    printf("CBOR: %d random packets decoded, %d differ", N, bad);
+    for (int f=0; f<12; f++) if (fields[f]) printf(", key %d: %d", f, fields[f]);
+    printf("\n");
+    return bad;
+}
+
+//===== Node registry
+
+// registryCheck feeds 10k node IDs, many times the table's capacity, through NodeRegistry and
+// a std::map like the one it replaced, timing updates and lookups. It checks that nodes are only
+// evicted once the table is full, that the ones evicted are those heard of least recently, and
+// that every node that doesn't fit is accounted for as an eviction.
+static int registryCheck() {
+    int bad = 0;
+    const int N = 10000, ROUNDS = 50;
+    std::set<uint32_t> unique;
+    srand(4);
+    while ((int)unique.size() < N) unique.insert(rand() | 1);
+    std::vector<uint32_t> ids(unique.begin(), unique.end());
+    for (int i=N-1; i>0; i--) std::swap(ids[i], ids[rand() % (i+1)]);
+    const char *gw = "rfgw/peer";
+    uint8_t level = evlogReg;
+    evlogReg = EVLOG_OFF; // evictions are logged as errors
+
+    // working sets up to capacity, each node is updated as packets arrive, none may be evicted
+    NodeRegistry *r;
+    int hot = 0;
+    for (int pct : { 25, 50, 100 }) {
+        r = new NodeRegistry("rfgw/self");
+        hot = NODE_CAP*pct/100;
+        int found = 0;
+        for (int k=0; k<3; k++) for (int i=0; i<hot; i++) r->addInfo(ids[i], gw, 10);
+        for (int i=0; i<hot; i++) found += r->find(ids[i]) != 0;
+        printf("Registry: %d nodes in %d slots, %d found, %u evicted\n", hot, MAX_NODES, found,
+                r->evictions);
+        CHECK(found == hot && r->numNodes == hot && r->evictions == 0);
+        delete r;
+    }
+
+    // full table, half of the nodes are heard from again, the other half gets evicted by as many
+    // new nodes
+    r = new NodeRegistry("rfgw/self");
+    for (int i=0; i<NODE_CAP; i++) r->addInfo(ids[i], gw, 10);
+    delay(2);
+    for (int i=0; i<NODE_CAP; i+=2) r->shouldAck(ids[i], 10, ACK_REGISTRY);
+    for (int i=0; i<NODE_CAP/2; i++) r->addInfo(ids[NODE_CAP+i], gw, 10);
+    int kept = 0, gone = 0;
+    for (int i=0; i<NODE_CAP; i++)
+        if (r->find(ids[i])) kept += i%2 == 0; else gone += i%2 == 1;
+    printf("Registry: table full, %d of %d recent nodes kept, %d of %d idle ones evicted\n",
+            kept, (NODE_CAP+1)/2, gone, NODE_CAP/2);
+    CHECK(kept == (NODE_CAP+1)/2 && gone == NODE_CAP/2 && (int)r->evictions == NODE_CAP/2);
+    delete r;
+
+    // 10k nodes, each update of a node that isn't in the table evicts another one
+    r = new NodeRegistry("rfgw/self");
+    for (int i=0; i<N; i++) r->addInfo(ids[i], gw, i%30);
+    printf("Registry: %d nodes through %d slots, %d in use, %u evicted\n",
+            N, MAX_NODES, r->numNodes, r->evictions);
+    CHECK(r->numNodes == NODE_CAP && (int)r->evictions == N - NODE_CAP);
+    volatile int sink = 0;
+    uint64_t t0 = esp_timer_get_time();
+    for (int k=0; k<ROUNDS; k++) for (int i=0; i<N; i++) r->addInfo(ids[i], gw, i%30);
+    uint64_t t1 = esp_timer_get_time();
+    for (int k=0; k<ROUNDS; k++) for (int i=0; i<N; i++) sink += r->isBest(ids[i]);
+    uint64_t t2 = esp_timer_get_time();
+    for (int k=0; k<ROUNDS; k++) for (int i=0; i<hot; i++) sink += r->isBest(ids[N-1-i]);
+    uint64_t t3 = esp_timer_get_time();
+    delete r;
+
+    // the std::map the registry used to be, it grows to hold every node
+    struct MapEntry { int16_t gwId = -1, margin = -100; uint32_t at = 0; };
+    std::map<uint32_t, MapEntry> m;
+    std::mutex mtx;
+    uint64_t t4 = esp_timer_get_time();
+    for (int k=0; k<ROUNDS; k++) {
+        for (int i=0; i<N; i++) {
+            std::lock_guard<std::mutex> lock(mtx);
+            MapEntry &e = m[ids[i]];
+            if (e.gwId < 0 || i%30 > e.margin) { e.gwId = 1; e.margin = i%30; e.at = millis(); }
+        }
+    }
+    uint64_t t5 = esp_timer_get_time();
+    for (int k=0; k<ROUNDS; k++) {
+        for (int i=0; i<N; i++) {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = m.find(ids[i]);
+            sink += it == m.end() || it->second.gwId <= 0;
+        }
+    }
+    uint64_t t6 = esp_timer_get_time();
+    double ops = (double)ROUNDS*N;
+    printf("Registry: update %.0fns (map %.0fns), lookup %.0fns (map %.0fns), "
+            "lookup of %d recent nodes %.0fns\n", (t1-t0)*1e3/ops, (t5-t4)*1e3/ops,
+            (t2-t1)*1e3/ops, (t6-t5)*1e3/ops, hot, (t3-t2)*1e3/(ROUNDS*hot));
+    evlogReg = level;
+    return bad;
+}
+
+//===== Flash log
+
+#define FLOG_REC  40
+#define FLOG_SIZE (4*LOG_SECTOR)
+
+// flashRecord fills record i with a pattern derived from i
+static void flashRecord(uint8_t *rec, uint32_t i) {
+    memcpy(rec, &i, 4);
+    for (int j=4; j<FLOG_REC; j++) rec[j] = i*7 + j;
+}
+
+static const esp_partition_t *flashPart() {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x40,
+            "pktlog");
+}
+
+// FlashProgress is shared with the writer process: records handed to the log before the write
+// in progress and records known to be on flash
+struct FlashProgress { volatile uint32_t attempted, durable; };
+
+// flashWriter runs in a child process, it appends records to an empty log and flushes every 7th
+// one until power is lost in the middle of the tear-th flash write
+static void flashWriter(int tear, FlashProgress *fp) {
+    static FlashLog log;
+    log.begin(flashPart(), FLOG_SIZE);
+    nativeFlashTear = tear;
+    uint8_t rec[FLOG_REC];
+    for (uint32_t i=0; ; i++) {
+        uint32_t w = log.writes;
+        flashRecord(rec, i);
+        fp->attempted = i;
+        log.append(rec, sizeof(rec));
+        if (i % 7 == 6) {
+            fp->attempted = i+1;
+            log.flush();
+        }
+        if (log.writes != w) fp->durable = fp->attempted;
+    }
+}
+
+// flashCheck tears flash writes at several points, recovers the log as after a reboot and
+// checks that the records that made it to flash are intact and in order, that publishing
+// resumes after the last consumed record (tail) and that records appended after the recovery
+// follow the old ones without overwriting them (head).
+static int flashCheck() {
+    int bad = 0;
+    const char *savedFile = nativeFlashFile;
+    char file[64];
+    snprintf(file, sizeof(file), "/tmp/flashcheck-%d.bin", (int)getpid());
+    nativeFlashFile = file;
+    FlashProgress *fp = (FlashProgress *)mmap(0, sizeof(FlashProgress), PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    const int NEW = 10;
+    uint8_t rec[FLOG_REC], want[FLOG_REC];
+    for (int tear : { 1, 2, 3, 8, 21, 40, 77 }) {
+        unlink(file);
+        nativeFlashReboot();
+        fp->attempted = fp->durable = 0;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            freopen("/dev/null", "w", stderr);
+            flashWriter(tear, fp);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 3);
+
+        // recover, consume half of the records and append new ones
+        FlashLog *log = new FlashLog;
+        nativeFlashReboot();
+        CHECK(log->begin(flashPart(), FLOG_SIZE));
+        uint32_t recovered = log->pending, corrupt = log->corrupt;
+        uint32_t first = 0, next = 0, got = 0;
+        for (uint32_t k=0; k<recovered/2 && log->next(rec, sizeof(rec)) == FLOG_REC; k++) {
+            uint32_t i;
+            memcpy(&i, rec, 4);
+            if (k == 0) first = next = i;
+            flashRecord(want, next++);
+            CHECK(memcmp(rec, want, FLOG_REC) == 0);
+            log->consume();
+            got++;
+        }
+        for (int j=0; j<NEW; j++) {
+            flashRecord(rec, 1000000+j);
+            log->append(rec, sizeof(rec));
+        }
+        log->flush();
+        delete log;
+
+        // reboot, the rest of the old records must come first, then the new ones
+        log = new FlashLog;
+        nativeFlashReboot();
+        CHECK(log->begin(flashPart(), FLOG_SIZE));
+        CHECK(log->pending == recovered - got + NEW);
+        for (uint32_t k=0; log->next(rec, sizeof(rec)) == FLOG_REC; k++) {
+            CHECK(k < recovered - got + NEW);
+            if (k >= recovered - got + NEW) break;
+            uint32_t i;
+            memcpy(&i, rec, 4);
+            if (got == 0 && k == 0 && recovered > 0) first = next = i;
+            if (k < recovered - got) flashRecord(want, next++);
+            else flashRecord(want, 1000000 + k - (recovered - got));
+            CHECK(memcmp(rec, want, FLOG_REC) == 0);
+            log->consume();
+        }
+        CHECK(log->pending == 0);
+        delete log;
+
+        // the old records end between the last completed write and the torn one, none before
+        // them is missing unless the log wrapped around
+        uint32_t last = first + recovered;
+        CHECK(recovered > 0 || fp->durable == 0);
+        CHECK(last >= fp->durable && last <= fp->attempted);
+        CHECK(first == 0 || fp->attempted*(sizeof(LogHeader)+FLOG_REC) > FLOG_SIZE-LOG_SECTOR);
+
+        // once consumed nothing is replayed after another reboot
+        log = new FlashLog;
+        nativeFlashReboot();
+        CHECK(log->begin(flashPart(), FLOG_SIZE));
+        CHECK(log->pending == 0 && log->next(rec, sizeof(rec)) == 0);
+        delete log;
+        printf("Flash: write %d torn, records %u..%u recovered (%u flushed, %u appended), "
+                "%u corrupt sectors\n", tear, first, last-1, fp->durable, fp->attempted, corrupt);
+    }
+    munmap(fp, sizeof(FlashProgress));
+    unlink(file);
+    nativeFlashReboot();
+    nativeFlashFile = savedFile;
+    return bad;
+}
+
+//===== Memory accounting
+
+// memRound runs n packets through the steady-state packet path with the tags the gateway uses:
+// the radio task takes a packet from the pool and decides on the ACK, loop() encodes it, queues
+// it until its PUBACK, holds it for deduplication and gossips about it, and the MQTT callbacks
+// feed the registry reports and summaries of a peer.
+static void memRound(NodeRegistryWorker &w, int n) {
+    static PacketQueue q;
+    static DedupCache<jlPacket*, DEDUP_SLOTS> dedup;
+    static GossipSummary peerSum;
+    static char buf[RX_JSON_MAX];
+    static uint8_t cbor[RX_CBOR_MAX], msg[GOSSIP_MSG_MAX];
+    char report[128];
+    for (int i=0; i<n; i++) {
+        uint32_t node = 0x1000 + i % 500;
+        memTag = MEM_RF;
+        jlPacket *pkt = pktPool.alloc();
+        if (!pkt) return;
+        randomPacket(pkt);
+        pkt->node = node;
+        bool ack = w.shouldAck(node, pkt->snr, ACK_REGISTRY);
+
+        memTag = MEM_PKT;
+        encodeRxJson(pkt, "rfgw/self", buf, sizeof(buf));
+        encodeRxCbor(pkt, "rfgw/self", cbor, sizeof(cbor));
+        uint16_t hash = dedupHash(pkt->fmt, pkt->data, pkt->dataLen);
+        uint16_t id = i % 0xffff + 1;
+        q.push(pkt, id, millis() + 1000);
+        q.remove(id);
+        jlPacket *held;
+        bool suppress;
+        if (dedup.add(pkt, node, hash, false, 100) == dedup.HOLD) {
+            dedup.peerPublished(node, hash);
+            while (dedup.poll(held, suppress)) { }
+        }
+
+        memTag = MEM_REG;
+        w.sendInfo(node, pkt->snr, ack, true, hash);
+        int len = snprintf(report, sizeof(report), "{\"gw\":\"rfgw/peer\",\"node\":%u,"
+                "\"margin\":%d}", node, i % 30);
+        w.onMqttMessage((char *)w.gwTopic, report, MqttProps{1, false, false}, len, 0, len);
+        if (!peerSum.add(node, i % 30, i % 2, hash, millis()) || i % 16 == 15) {
+            len = peerSum.encode("rfgw/peer2", msg, sizeof(msg), millis());
+            w.onMqttMessage(w.gwTopicBin, (char *)msg, MqttProps{1, false, false}, len, 0, len);
+        }
+
+        memTag = MEM_PKT;
+        pktPool.free(pkt);
+    }
+    memTag = MEM_OTHER;
+}
+
+// memCheck runs the steady-state packet path twice, once to warm up and once more after taking
+// a snapshot of the memory accounting, and checks that no subsystem holds more memory after the
+// second round than after the first, i.e., that nothing on the path leaks.
+static int memCheck() {
+    int bad = 0;
+    const int N = 20000;
+    memTagReady = true; // as setup() does
+    // the accounting must see allocations and credit frees to the allocating subsystem
+    static uint32_t *volatile p; // volatile: the compiler may not elide new and delete
+    MemStats m0 = memAcct.get(MEM_WEB);
+    { MemScope mem(MEM_WEB); p = new uint32_t[10]; }
+    MemStats m1 = memAcct.get(MEM_WEB);
+    delete[] p;
+    MemStats m2 = memAcct.get(MEM_WEB);
+    CHECK(m1.live == m0.live+1 && m1.bytes == m0.bytes+40);
+    CHECK(m2.live == m0.live && m2.bytes == m0.bytes);
+
+    NodeRegistryWorker *w = new NodeRegistryWorker("rfgw/self");
+    snprintf(w->gwTopicBin, sizeof(w->gwTopicBin), "%sb", w->gwTopic); // as setup() does
+    FILE *out = stdout;
+    stdout = fopen("/dev/null", "w");
+    memRound(*w, N);
+    MemStats first[MEM_NUM];
+    for (int i=0; i<MEM_NUM; i++) first[i] = memAcct.get(i);
+    memRound(*w, N);
+    fclose(stdout);
+    stdout = out;
+    printf("Memory: %d packets twice, second round:", N);
+    for (int i=0; i<MEM_NUM; i++) {
+        MemStats m = memAcct.get(i);
+        printf(" %s %u allocs %+dB%s", memTagName[i], m.allocs - first[i].allocs,
+                (int)(m.bytes - first[i].bytes), i < MEM_NUM-1 ? ";" : "\n");
+    }
+    for (int i=0; i<MEM_NUM; i++) {
+        MemStats m = memAcct.get(i);
+        CHECK(m.live == first[i].live && m.bytes == first[i].bytes);
+    }
+    delete w;
+    return bad;
+}
+
+//=====
+
+struct Check {
+    const char *name;
+    int (*run)();
+};
+
+static const Check checks[] = {
+    { "pool", poolCheck },
+    { "ring", ringCheck },
+    { "queue", queueCheck },
+    { "json", jsonCheck },
+    { "cbor", cborCheck },
+    { "registry", registryCheck },
+    { "flash", flashCheck },
+    { "memory", memCheck },
+};
+
+// runCheck runs the named check, or all of them, and returns the number of failures or -1 if
+// there is no such check
+int runCheck(const char *name) {
+    bool all = strcmp(name, "all") == 0;
+    int bad = -1;
+    for (const Check &c : checks) {
+        if (!all && strcmp(name, c.name) != 0) continue;
+        int n = c.run();
+        bad = (bad < 0 ? 0 : bad) + n;
+        if (n > 0) printf("%s: %d failures\n", c.name, n);
+    }
+    return bad;
+}
@@ -0,0 +1,22 @@
+// Host stand-in for the ESP-IDF ADC driver, reads a fixed mid-scale value taking as long as a
+// conversion on the ESP32
+#pragma once
+
+#include <chrono>
+
+#ifndef ADC_CONV_US
+#define ADC_CONV_US 60
+#endif
+
+typedef int adc1_channel_t;
+#define ADC_WIDTH_BIT_12 12
+#define ADC_ATTEN_DB_11  3
+#define ADC_UNIT_1       1
+static inline void adc1_config_width(int w) { }
+static inline void adc1_config_channel_atten(adc1_channel_t c, int a) { }
+static inline int adc1_get_raw(adc1_channel_t c) {
+    auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(ADC_CONV_US);
+    while (std::chrono::steady_clock::now() < end)
+        ;
+    return 2048;
+}
@@ -0,0 +1,4 @@
+// Host stand-in for esp32-hal.h
+#pragma once
+#include "Arduino.h"
+static inline int digitalPinToAnalogChannel(int pin) { return pin; }
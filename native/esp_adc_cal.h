@@ -0,0 +1,11 @@
+// Host stand-in for the ESP-IDF ADC calibration API
+#pragma once
+
+#include <stdint.h>
+typedef struct { uint32_t vref; } esp_adc_cal_characteristics_t;
+typedef enum { ESP_ADC_CAL_VAL_EFUSE_VREF, ESP_ADC_CAL_VAL_EFUSE_TP, ESP_ADC_CAL_VAL_DEFAULT_VREF } esp_adc_cal_value_t;
+static inline esp_adc_cal_value_t esp_adc_cal_characterize(int unit, int atten, int width,
+        uint32_t vref, esp_adc_cal_characteristics_t *chars) { chars->vref = vref; return ESP_ADC_CAL_VAL_DEFAULT_VREF; }
+static inline uint32_t esp_adc_cal_raw_to_voltage(uint32_t raw, const esp_adc_cal_characteristics_t *chars) {
+    return raw * 3900 / 4095;
+}
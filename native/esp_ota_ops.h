@@ -0,0 +1,15 @@
+// Host stand-in for the ESP-IDF OTA API, see native/flash.cpp
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#pragma once
+
+#include "esp_partition.h"
+
+#define ESP_ERR_OTA_VALIDATE_FAILED 0x1503
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part);
+
+// host-only
+extern uint32_t nativeOtaErases;                // sectors of the update partition erased
+extern const esp_partition_t *nativeBootPartition; // set by esp_ota_set_boot_partition
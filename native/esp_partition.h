@@ -0,0 +1,44 @@
+// Host stand-in for the ESP-IDF partition API: a single data partition emulating NOR flash
+// (erase sets bytes to 0xff, writes can only clear bits) backed by a file so its content
+// survives restarts. See native/flash.cpp.
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int esp_err_t;
+#define ESP_OK              0
+#define ESP_FAIL            -1
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_SIZE 0x104
+
+typedef enum { ESP_PARTITION_TYPE_APP = 0, ESP_PARTITION_TYPE_DATA = 1 } esp_partition_type_t;
+typedef int esp_partition_subtype_t;
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef struct {
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+    bool encrypted;
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+        esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t off, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t off, const void *src,
+        size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t off, size_t size);
+
+// host-only controls, set before the gateway's setup() runs
+extern const char *nativeFlashFile; // backing file, NULL: flash content is not persisted
+extern uint32_t nativeFlashSize;    // partition size, default 256KB, 0: no pktlog partition
+extern int nativeFlashTear;         // >0: the Nth write is torn in half and the process exits
+extern uint32_t nativeFlashWrites, nativeFlashErases;
+// nativeFlashReboot drops the flash content held in memory, the next esp_partition_find_first
+// reloads it from nativeFlashFile like after a reboot
+void nativeFlashReboot();
@@ -0,0 +1,133 @@
+// Host stand-in for the ESP-IDF partition and OTA APIs, see esp_partition.h and esp_ota_ops.h
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+const char *nativeFlashFile = 0;
+uint32_t nativeFlashSize = 256*1024;
+int nativeFlashTear = 0;
+uint32_t nativeFlashWrites = 0, nativeFlashErases = 0;
+
+static esp_partition_t part;
+static std::vector<uint8_t> mem;
+static FILE *file;
+
+// the OTA update partition lives in RAM only, the counters above are about pktlog
+static esp_partition_t app;
+static std::vector<uint8_t> appMem;
+
+// sync writes a range of the flash content through to the backing file
+static void sync(size_t off, size_t size) {
+    if (!file) return;
+    fseek(file, off, SEEK_SET);
+    fwrite(mem.data()+off, 1, size, file);
+    fflush(file);
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+        esp_partition_subtype_t subtype, const char *label)
+{
+    if (type != ESP_PARTITION_TYPE_DATA || strcmp(label, "pktlog") != 0 || !nativeFlashSize)
+        return 0;
+    if (mem.empty()) {
+        mem.assign(nativeFlashSize, 0xff);
+        if (nativeFlashFile) {
+            file = fopen(nativeFlashFile, "r+b");
+            if (file) {
+                fread(mem.data(), 1, mem.size(), file);
+            } else {
+                file = fopen(nativeFlashFile, "w+b");
+                if (!file) { perror(nativeFlashFile); return 0; }
+                sync(0, mem.size());
+            }
+        }
+        part.type = type;
+        part.subtype = subtype;
+        part.size = nativeFlashSize;
+        strcpy(part.label, label);
+    }
+    return &part;
+}
+
+void nativeFlashReboot() {
+    if (file) fclose(file);
+    file = 0;
+    mem.clear();
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t off, void *dst, size_t size) {
+    if (p == &app) {
+        if (off + size > appMem.size()) return ESP_ERR_INVALID_SIZE;
+        memcpy(dst, appMem.data()+off, size);
+        return ESP_OK;
+    }
+    if (off + size > mem.size()) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, mem.data()+off, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t off, const void *src,
+        size_t size)
+{
+    if (p == &app) {
+        if (off + size > appMem.size()) return ESP_ERR_INVALID_SIZE;
+        const uint8_t *s = (const uint8_t *)src;
+        for (size_t i=0; i<size; i++) appMem[off+i] &= s[i];
+        return ESP_OK;
+    }
+    if (off + size > mem.size()) return ESP_ERR_INVALID_SIZE;
+    nativeFlashWrites++;
+    bool tear = nativeFlashTear > 0 && --nativeFlashTear == 0;
+    if (tear) size /= 2; // simulate power loss in the middle of the write
+    const uint8_t *s = (const uint8_t *)src;
+    for (size_t i=0; i<size; i++) mem[off+i] &= s[i]; // NOR flash can only clear bits
+    sync(off, size);
+    if (tear) {
+        fprintf(stderr, "flash: power loss during write of %zu bytes at %zu\n", size*2, off);
+        _exit(3);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t off, size_t size) {
+    if (p == &app) {
+        if (off % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE || off + size > appMem.size())
+            return ESP_ERR_INVALID_ARG;
+        nativeOtaErases++;
+        memset(appMem.data()+off, 0xff, size);
+        return ESP_OK;
+    }
+    if (off % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE || off + size > mem.size())
+        return ESP_ERR_INVALID_ARG;
+    nativeFlashErases++;
+    memset(mem.data()+off, 0xff, size);
+    sync(off, size);
+    return ESP_OK;
+}
+
+uint32_t nativeOtaErases = 0;
+const esp_partition_t *nativeBootPartition = 0;
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start) {
+    if (appMem.empty()) {
+        appMem.assign(0x140000, 0xff);
+        app.type = ESP_PARTITION_TYPE_APP;
+        app.subtype = 0x11; // ota_1
+        app.size = appMem.size();
+        strcpy(app.label, "app1");
+    }
+    return &app;
+}
+
+// esp_ota_set_boot_partition only checks the image's magic byte, the real one verifies the
+// image's segments and hash
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *p) {
+    if (p != &app || appMem[0] != 0xe9) return ESP_ERR_OTA_VALIDATE_FAILED;
+    nativeBootPartition = p;
+    return ESP_OK;
+}
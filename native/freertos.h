@@ -0,0 +1,71 @@
+// Host stand-in for the FreeRTOS primitives used by the gateway, mapped onto std::thread
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void *);
+struct NativeTask;
+typedef NativeTask *TaskHandle_t;
+
+#define pdPASS              1
+#define pdTRUE              1
+#define pdFALSE             0
+#define portMAX_DELAY       0xffffffffu
+#define portTICK_PERIOD_MS  1
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(ms))
+#define configMAX_PRIORITIES 25
+
+// portMUX spinlocks become std::atomic_flag spinlocks
+struct portMUX_TYPE { std::atomic_flag f = ATOMIC_FLAG_INIT; };
+#define portMUX_INITIALIZER_UNLOCKED {}
+static inline void portENTER_CRITICAL(portMUX_TYPE *m) { while (m->f.test_and_set(std::memory_order_acquire)) ; }
+static inline void portEXIT_CRITICAL(portMUX_TYPE *m) { m->f.clear(std::memory_order_release); }
+#define portENTER_CRITICAL_ISR portENTER_CRITICAL
+#define portEXIT_CRITICAL_ISR portEXIT_CRITICAL
+
+static inline void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+static inline void taskYIELD() { std::this_thread::yield(); }
+
+// task notifications are a counter per thread guarded by a condition variable
+struct NativeTask {
+    std::mutex mtx;
+    std::condition_variable cv;
+    uint32_t count = 0;
+};
+static inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+    static thread_local NativeTask task;
+    return &task;
+}
+static inline void xTaskNotifyGive(TaskHandle_t t) {
+    std::lock_guard<std::mutex> lk(t->mtx);
+    t->count++;
+    t->cv.notify_one();
+}
+#define vTaskNotifyGiveFromISR(t, woken) xTaskNotifyGive(t)
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    NativeTask *t = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lk(t->mtx);
+    t->cv.wait_for(lk, std::chrono::milliseconds(ticks), [t] { return t->count > 0; });
+    uint32_t n = t->count;
+    if (n > 0) t->count = clear ? 0 : n-1;
+    return n;
+}
+
+// xTaskCreatePinnedToCore runs the task on a detached thread, the core and priority are ignored
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+        uint32_t stack, void *arg, int prio, TaskHandle_t *handle, int core)
+{
+    std::thread(fn, arg).detach();
+    if (handle) *handle = 0;
+    return pdPASS;
+}
@@ -0,0 +1,21 @@
+// Host stand-in for the libb64 encoder bundled with Arduino-ESP32
+#pragma once
+
+#define base64_encode_expected_len(n) ((((4 * (n)) / 3) + 3) & ~3)
+
+static inline int base64_encode_chars(const char *in, int len, char *out) {
+    static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *)in;
+    char *o = out;
+    for (int i=0; i<len; i+=3) {
+        uint32_t v = p[i] << 16;
+        if (i+1 < len) v |= p[i+1] << 8;
+        if (i+2 < len) v |= p[i+2];
+        *o++ = tbl[(v>>18)&63];
+        *o++ = tbl[(v>>12)&63];
+        *o++ = i+1 < len ? tbl[(v>>6)&63] : '=';
+        *o++ = i+2 < len ? tbl[v&63] : '=';
+    }
+    *o = 0;
+    return o - out;
+}
@@ -0,0 +1,12 @@
+// Host stand-in for the lwip SNTP client, the host clock is used as-is
+#pragma once
+
+#include <stdint.h>
+
+typedef struct { uint32_t addr; } ip_addr_t;
+#define IPADDR4_INIT(a) { a }
+#define IPADDR4_INIT_BYTES(a,b,c,d) { (uint32_t)((a)|((b)<<8)|((c)<<16)|((d)<<24)) }
+#define SNTP_OPMODE_POLL 0
+static inline void sntp_setoperatingmode(int m) { }
+static inline void sntp_setserver(int i, const ip_addr_t *a) { }
+static inline void sntp_init() { }
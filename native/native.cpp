@@ -0,0 +1,743 @@
+// ESP32 FSK Radio to MQTT gateway - host build
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Runs the real setup()/loop() against the fake radio and MQTT client in this directory and
+// reports throughput and per-stage latency of the RX->publish path:
+//   radio:   frame injected -> frame read by rfLoop() in the radio task
+//   gateway: frame read -> first publish of the packet (decode, ACK, ring, encode)
+//   puback:  publish -> PUBACK callback
+//
+// Usage: pio run -e native && .pio/build/native/program [options]
+//   -n packets   number of packets to inject (default 10000)
+//   -r rate      packets per second, 0 injects as fast as the gateway keeps up (default 0)
+//   -N nodes     number of distinct node IDs (default 200)
+//   -d ms        PUBACK delay (default 5)
+//   -l pct       percentage of PUBACKs lost (default 0)
+//   -b ms        rxBatchMs, 0 disables batching (default 0)
+//   -f fmt       rxFormat, 1=JSON 2=CBOR 3=both (default 1)
+//   -w file      record the received frames to a capture file, see capture.h
+//   -c file      inject the frames of a capture file instead of synthetic traffic
+//   -s speed     capture replay speed-up factor, 0 injects as fast as possible (default 1)
+//   -g gateways  simulate gateways-1 peers that hear every packet and gossip about it (default 1)
+//   -G           gossipBinary: exchange binary summaries instead of JSON reports
+//   -a mode      ackMode, 0=registry 1=arbitrate (default 0)
+//   -e ms        delay of messages echoed by the broker, i.e. of gossip (default 0)
+//   -D mode      rxDedup, 1: only the designated gateway publishes, 2: the others publish a
+//                reception record (default 0), the peers of -g follow the same policy
+//   -m pct       percentage of packets each peer misses (default 0)
+//   -F file      back the pktlog flash partition with file so the log survives restarts,
+//                -F none removes the partition so packets are only queued in RAM
+//   -o from:to   MQTT outage: disconnect before injecting packet from, reconnect before packet to
+//   -p pps       drainPps, rate at which the backlog is published after an outage (default 100)
+//   -W n         drainWindow, max packets in flight while draining the backlog (default 16)
+//   -x n         power loss: tear the n-th flash write in half and exit with status 3, rerun
+//                with the same -F file to check that the log recovers, -T flash does this at
+//                several points
+//   -V           check the "data" array of the JSON encoder against the baseline's sendPacket
+//                code on random payloads, compare varint.h's speed with decodeVarints, then exit
+//   -T check     run a check and micro-benchmark of a building block, then exit, see checks.cpp:
+//                pool, ring, queue, json, cbor, registry, flash, memory, or all
+//   -R radios    number of fake radios on different channels, 1..4 (default 1)
+//   -H pct       percentage of the packets received by radio 0, the others share the rest
+//                (default: all radios get the same share)
+//   -U kb        stream a kb KB firmware image to the gateway over MQTT while the packets flow,
+//                the second chunk is corrupted once to exercise the CRC check, see ota.h
+//   -M ms        scrape /metrics every ms milliseconds while the packets flow, report the
+//                handler's run time and print the last response
+//   -q           quiet: suppress the gateway's printf output
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <SX1276fsk.h>
+#include <ESPSecureBase.h>
+#include <ESPAsyncWebServer.h>
+#include <unistd.h>
+#include "../formats.h"
+#include "../capture.h"
+#include "../registry.h"
+#include "../histogram.h"
+#include "../flashlog.h"
+#include "../dedup.h"
+#include "../varint.h"
+#include "../radio.h"
+#include "../memacct.h"
+#include "../ota.h"
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+AsyncMqttClient mqttClient;
+char mqTopic[] = "rfgw/native";
+int mqTopicLen = sizeof(mqTopic)-1;
+uint32_t mqPingMs = 0;
+
+void setup();
+void loop();
+extern Radio radios[];
+extern int rfNum;
+extern uint8_t rxFormat;
+extern uint32_t rxBatchMs;
+extern uint8_t rfCapture;
+extern uint8_t gossipBinary;
+extern uint32_t gossipMs;
+extern uint8_t ackMode;
+extern LogHistogram ackLatency;
+extern uint32_t ackLate;
+extern LogHistogram loopLatency, wakeLatency;
+extern AsyncWebServer webServer;
+extern uint32_t metricsRetries;
+extern uint64_t loopIdleUs;
+void loopWake();
+extern uint32_t vBatt, vBattUs;
+extern NodeRegistryWorker nrw;
+extern FlashLog flashLog;
+extern uint8_t rxDedup;
+extern uint32_t dedupMs;
+extern DedupCache<jlPacket*, DEDUP_SLOTS> dedup;
+extern uint32_t drainPps, drainWindow;
+extern int inFlightMax;
+extern uint32_t drainNum;
+int runCheck(const char *name);
+
+//===== Synthetic traffic
+
+// putVarint appends a JeeLabs varint and returns the number of bytes
+static int putVarint(uint8_t *buf, int32_t v) {
+    uint32_t z = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+    uint8_t tmp[5];
+    int n = 0;
+    do { tmp[n++] = z & 0x7f; z >>= 7; } while (z);
+    for (int i=0; i<n; i++) buf[i] = tmp[n-1-i];
+    buf[n-1] |= 0x80;
+    return n;
+}
+
+// makeFrame fills buf with a JeeLabs v2 packet (or v1 for odd nodes) carrying a few varints
+static int makeFrame(uint8_t *buf, uint32_t node, uint32_t seq) {
+    int len = 0;
+    if (node & 1) {
+        buf[len++] = 0x00;              // dest: GW
+        buf[len++] = 0x80 | 61;         // ack req, src: tx-only node
+        buf[len++] = 0x80 | 5;          // info trailer, fmt
+        len += putVarint(buf+len, node);
+    } else {
+        buf[len++] = 0x12;              // data, to-GW, ack req, v2
+        memcpy(buf+len, &node, 4); len += 4;
+        buf[len++] = 0x80 | 5;          // info trailer, fmt
+    }
+    len += putVarint(buf+len, seq);
+    len += putVarint(buf+len, -(int32_t)(seq % 1000));
+    len += putVarint(buf+len, 22345);
+    len += putVarint(buf+len, 3300 + seq%100);
+    buf[len++] = 20;                    // remote margin
+    buf[len++] = 0xfe;                  // remote FEI
+    return len;
+}
+
+static std::mutex mtx;
+
+//===== Peer gateways
+
+// Peers run their own NodeRegistryWorker on the shared fake MQTT client, so they gossip with the
+// gateway under test and with each other through the simulated broker. They hear every packet
+// and make their own ACK and publish decisions.
+struct Peer {
+    char name[GW_NAME_LEN];
+    NodeRegistryWorker *nrw;
+    DedupCache<uint32_t, DEDUP_SLOTS> *dedup; // holds sequence numbers
+};
+static std::vector<Peer> peers;
+static uint32_t gossipNum = 0, gossipBytes = 0; // gossip published by all gateways
+
+// ACK accounting: number of gateways that ACKed each packet, by sequence number
+static std::map<uint32_t, int> pktAcks;
+static std::deque<uint32_t> rxSeq[4]; // sequence numbers of frames injected into each radio
+static uint32_t curSeq;             // frame being processed by the radio task
+
+// simMargin returns the margin at which gateway gw (0: the one under test) hears node: a fixed
+// 5..34dB per gateway/node pair plus +/-2dB of noise
+static int simMargin(int gw, uint32_t node) {
+    uint32_t h = (node * 2654435769u) ^ (gw * 40503u);
+    h = (h ^ (h >> 15)) * 2246822519u;
+    return 5 + (h >> 8) % 30 + rand()%5 - 2;
+}
+
+// copies counts how many gateways published each packet, by sequence number
+static std::map<uint32_t, int> copies;
+
+static int peerMissPct = 0;
+
+static void peersHear(uint32_t node, uint32_t seq, uint8_t *frame, int len) {
+    uint16_t hash = 0;
+    if (rxDedup) {
+        struct timeval at = { 0, 0 };
+        jlPacket *pkt = processRFPacket(frame, len, at, 0, 0, 0);
+        if (pkt) {
+            hash = dedupHash(pkt->fmt, pkt->data, pkt->dataLen);
+            pktPool.free(pkt);
+        }
+    }
+    for (size_t i=0; i<peers.size(); i++) {
+        Peer &p = peers[i];
+        if (rand()%100 < peerMissPct) continue;
+        int margin = simMargin(i+1, node);
+        bool ack = p.nrw->shouldAck(node, margin, ackMode);
+        int action = p.dedup->PUBLISH;
+        if (hash) action = p.dedup->add(seq, node, hash, p.nrw->designated(node), dedupMs);
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (ack) pktAcks[seq]++;
+            if (action == p.dedup->PUBLISH) copies[seq]++;
+        }
+        p.nrw->sendInfo(node, margin, ack, gossipBinary, action == p.dedup->PUBLISH ? hash : 0);
+    }
+}
+
+static void peersLoop() {
+    for (Peer &p : peers) {
+        p.nrw->loop(gossipMs);
+        uint32_t seq;
+        bool suppress;
+        while (p.dedup->poll(seq, suppress)) {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (!suppress) copies[seq]++;
+        }
+    }
+}
+
+// countCopies credits the gateway under test with the packets in a JSON message on <topic>/rx,
+// it finds each packet's sequence number two values before the 22345 put in by makeFrame
+static void countCopies(const char *payload, size_t len) {
+    static const char key[] = "\"data\":[";
+    const char *end = payload+len;
+    for (const char *p = payload; (p = std::search(p, end, key, key+8)) != end; ) {
+        p += 8;
+        std::vector<long> v;
+        while (p < end && *p != ']') {
+            v.push_back(strtol(p, (char **)&p, 10));
+            if (*p == ',') p++;
+        }
+        for (size_t i=2; i<v.size(); i++) if (v[i] == 22345) { copies[v[i-2]]++; break; }
+    }
+}
+
+//===== Stats
+
+static std::deque<uint64_t> rxInjected, rxRead; // per-packet timestamps awaiting their publish
+static std::vector<uint32_t> radioLat, gwLat, pubackLat;
+static std::vector<uint32_t> radioLatBy[4]; // radio latency of each radio
+static std::map<uint16_t, uint64_t> pubAt;
+static uint32_t published = 0, rexmits = 0, receptions = 0;
+
+static void printLat(const char *name, std::vector<uint32_t> &v) {
+    if (v.empty()) { printf("  %-8s no samples\n", name); return; }
+    std::sort(v.begin(), v.end());
+    printf("  %-8s p50 %6uus  p90 %6uus  p99 %6uus  max %6uus  (%zu samples)\n", name,
+            v[v.size()/2], v[v.size()*9/10], v[v.size()*99/100], v.back(), v.size());
+}
+
+//===== OTA sender
+
+// otaSend publishes the image in chunks on <topic>/ota/chunk at OTA_KBPS, each chunk continuing
+// from the offset in the gateway's latest status, like a sender would, see ota.h
+#define OTA_KBPS 200
+#define OTA_FRAG 1436 // the broker hands chunks over in fragments of the size of a TCP segment
+static std::vector<uint8_t> otaImage;
+static uint32_t otaImageId;
+static uint32_t otaNext = 0;        // offset the gateway expects next
+static std::string otaStatus;       // latest <topic>/ota/status published by the gateway
+static bool otaDone = false;
+static uint32_t otaSent = 0;        // chunks sent
+static uint64_t otaStartAt = 0, otaSentAt = 0;
+
+static void otaMakeImage(int kb) {
+    otaImage.resize(kb*1024 + 123); // the last chunk is partial
+    for (auto &b : otaImage) b = rand();
+    otaImage[0] = 0xe9; // ESP32 image magic
+    otaImageId = crc32(0, otaImage.data(), otaImage.size());
+}
+
+// otaStatusMsg is called by the publish hook with the status published by the gateway
+static void otaStatusMsg(const char *payload, size_t len) {
+    otaStatus.assign(payload, len);
+    const char *p = strstr(otaStatus.c_str(), "\"next\":");
+    if (p) otaNext = atoi(p+7);
+    if (strstr(otaStatus.c_str(), "\"state\":\"done\"")) otaDone = true;
+}
+
+// otaSend sends the next chunk when it's due, it returns true if it did
+static bool otaSend(uint64_t now) {
+    static uint64_t dueAt = 0;
+    if (otaImage.empty() || otaDone || !mqttClient.connected() || now < dueAt) return false;
+    uint32_t off = otaNext;
+    if (off >= otaImage.size()) return false;
+    uint32_t n = otaImage.size()-off < OTA_CHUNK_SIZE ? otaImage.size()-off : OTA_CHUNK_SIZE;
+    std::vector<char> msg(sizeof(OtaChunk)+n);
+    OtaChunk hdr = { OTA_MAGIC, otaImageId, (uint32_t)otaImage.size(), off,
+        crc32(0, otaImage.data()+off, n) };
+    memcpy(msg.data(), &hdr, sizeof(hdr));
+    memcpy(msg.data()+sizeof(hdr), otaImage.data()+off, n);
+    if (otaSent == 1) msg[sizeof(hdr)+n/2] ^= 1;
+    if (otaSent == 0) otaStartAt = now;
+    char topic[64];
+    snprintf(topic, sizeof(topic), "%s/ota/chunk", mqTopic);
+    mqttClient.deliver(topic, msg.data(), msg.size(), OTA_FRAG);
+    otaSent++;
+    otaSentAt = now;
+    dueAt = now + (uint64_t)msg.size()*1000/OTA_KBPS;
+    return true;
+}
+
+//===== Varint decoder check
+
+// baselineData is the part of the baseline's sendPacket that appends the varint-decoded payload,
+// verbatim but for counting the payloads it cannot decode instead of printing them. It decodes
+// at most 20 values.
+static int baselineFails = 0;
+static std::string baselineData(jlPacket *pkt) {
+    char buf[512];
+    int len = 0;
+    // add the varint-decoded payload as data array
+    if (pkt->dataLen > 0) {
+        int32_t data[20];
+        int c = decodeVarints(pkt->data, pkt->dataLen, data, 20);
+        if (c > 0) {
+            len += snprintf(buf+len, sizeof(buf)-len-2, ",\"data\":[");
+            for (int i=0; i<c; i++)
+                len += snprintf(buf+len, sizeof(buf)-len-2, "%d%c", data[i], i==c-1?']':',');
+        } else {
+            baselineFails++;
+        }
+    }
+    return std::string(buf, len);
+}
+
+// varintCheck fuzzes the "data" array produced by encodeRxJson against the one produced by the
+// baseline's sendPacket code. The baseline gives up on payloads of more than 20 values, so they
+// are fed to it in chunks of 20 values and the arrays are joined. It also times varintCount and
+// VarintReader against decodeVarints on full-size payloads. It returns the number of mismatches.
+static int varintCheck() {
+    const int N = 200000;
+    static uint8_t bufs[1000][JL_MAX_PKT];
+    static int lens[1000];
+    int32_t ref[JL_MAX_PKT], v;
+    static uint8_t pktBuf[sizeof(jlPacket)+JL_MAX_PKT], chunkBuf[sizeof(jlPacket)+JL_MAX_PKT];
+    jlPacket *pkt = (jlPacket *)pktBuf, *chunk = (jlPacket *)chunkBuf;
+    uint8_t *data = pktBuf + offsetof(jlPacket, data);
+    char out[600];
+    const char *key = ",\"data\":[";
+    int bad = 0, long20 = 0;
+    for (int i=0; i<N; i++) {
+        // random payloads, biased towards the short values nodes send, a third is incomplete
+        int len = rand() % (JL_MAX_PKT+1);
+        for (int j=0; j<len; j++) data[j] = rand() % 3 ? rand() | 0x80 : rand() & 0x7f;
+        if (len > 0 && rand() % 3) data[len-1] |= 0x80;
+        pkt->dataLen = len;
+
+        // the baseline's array, in chunks of up to 20 values if the payload is complete
+        std::string want;
+        if (len > 0 && (data[len-1] & 0x80)) {
+            int start = 0, n = 0;
+            for (int j=0; j<len; j++) {
+                if (!(data[j] & 0x80) || (++n % 20 != 0 && j != len-1)) continue;
+                chunk->dataLen = j+1-start;
+                memcpy(chunkBuf + offsetof(jlPacket, data), data+start, j+1-start);
+                std::string a = baselineData(chunk);
+                if (want.empty()) want = a;
+                else { want.back() = ','; want += a.substr(strlen(key)); }
+                start = j+1;
+            }
+            if (n > 20) long20++;
+        } else {
+            want = baselineData(pkt);
+        }
+
+        // the new one
+        int l = encodeRxJson(pkt, "rfgw/native", out, sizeof(out));
+        std::string got = l > 0 ? std::string(out, l) : "";
+        size_t at = got.find(key);
+        got = at == std::string::npos ? "" : got.substr(at, got.find(']', at) + 1 - at);
+        if (l <= 0 || got != want) {
+            if (bad++ < 10) {
+                printf("Mismatch: len=%d\n  baseline %s\n  new      %s\n ", len, want.c_str(),
+                        got.c_str());
+                for (int j=0; j<len; j++) printf(" %02x", data[j]);
+                printf("\n");
+            }
+        }
+        if (i < 1000) {
+            memcpy(bufs[i], data, len);
+            lens[i] = len;
+        }
+    }
+    printf("Varint fuzz: %d payloads, %d with more than 20 values, %d mismatches\n", N, long20, bad);
+
+    // throughput on full-size payloads of complete 1..3 byte values, as nodes send them
+    for (int i=0; i<1000; i++) {
+        int len = 0;
+        while (len < JL_MAX_PKT-3) {
+            int n = 1 + rand()%3;
+            for (int j=0; j<n; j++) bufs[i][len++] = rand() & 0x7f;
+            bufs[i][len-1] |= 0x80;
+        }
+        lens[i] = len;
+    }
+    const int ROUNDS = 200;
+    int64_t sum = 0;
+    uint64_t t0 = esp_timer_get_time();
+    for (int k=0; k<ROUNDS; k++) {
+        for (int i=0; i<1000; i++) {
+            int n = decodeVarints(bufs[i], lens[i], ref, JL_MAX_PKT);
+            for (int j=0; j<n; j++) sum += ref[j];
+        }
+    }
+    uint64_t t1 = esp_timer_get_time();
+    for (int k=0; k<ROUNDS; k++) {
+        for (int i=0; i<1000; i++) {
+            if (varintCount(bufs[i], lens[i]) <= 0) continue;
+            VarintReader r(bufs[i], lens[i]);
+            while (r.next(v)) sum -= v;
+        }
+    }
+    uint64_t t2 = esp_timer_get_time();
+    double bytes = 0;
+    for (int i=0; i<1000; i++) bytes += lens[i];
+    bytes *= ROUNDS;
+    printf("Varint decode: reference %.0fMB/s, new %.0fMB/s (checksum %lld)\n",
+            bytes/(t1-t0), bytes/(t2-t1), (long long)sum);
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    int numPkts = 10000, rate = 0, numNodes = 200, speed = 1, numGW = 1;
+    int outFrom = -1, outTo = -1, numRadios = 1, hotPct = 0, scrapeMs = 0;
+    bool quiet = false;
+    static FILE *capFile = 0;
+    std::vector<uint8_t> replay;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:N:d:l:b:f:w:c:s:g:Ga:e:D:m:F:o:p:W:x:R:H:M:U:VT:q")) != -1) {
+        switch (opt) {
+        case 'n': numPkts = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'N': numNodes = atoi(optarg); break;
+        case 'd': mqttClient.ackDelayMs = atoi(optarg); break;
+        case 'l': mqttClient.lossPct = atoi(optarg); break;
+        case 'b': rxBatchMs = atoi(optarg); break;
+        case 'f': rxFormat = atoi(optarg); break;
+        case 'w':
+            capFile = fopen(optarg, "wb");
+            if (!capFile) { perror(optarg); return 1; }
+            rfCapture = 1;
+            break;
+        case 'c': {
+            FILE *f = fopen(optarg, "rb");
+            if (!f) { perror(optarg); return 1; }
+            uint8_t b[4096];
+            size_t n;
+            while ((n = fread(b, 1, sizeof(b), f)) > 0) replay.insert(replay.end(), b, b+n);
+            fclose(f);
+            break; }
+        case 's': speed = atoi(optarg); break;
+        case 'g': numGW = atoi(optarg); break;
+        case 'G': gossipBinary = 1; break;
+        case 'a': ackMode = atoi(optarg); break;
+        case 'e': mqttClient.echoDelayMs = atoi(optarg); break;
+        case 'm': peerMissPct = atoi(optarg); break;
+        case 'D': rxDedup = atoi(optarg); break;
+        case 'F':
+            if (strcmp(optarg, "none") == 0) nativeFlashSize = 0;
+            else nativeFlashFile = optarg;
+            break;
+        case 'o': sscanf(optarg, "%d:%d", &outFrom, &outTo); break;
+        case 'p': drainPps = atoi(optarg); break;
+        case 'W': drainWindow = atoi(optarg); break;
+        case 'x': nativeFlashTear = atoi(optarg); break;
+        case 'R': numRadios = atoi(optarg) < 1 ? 1 : atoi(optarg) > 4 ? 4 : atoi(optarg); break;
+        case 'H': hotPct = atoi(optarg); break;
+        case 'U': otaMakeImage(atoi(optarg)); break;
+        case 'M': scrapeMs = atoi(optarg); break;
+        case 'V': return varintCheck() ? 1 : 0;
+        case 'T': {
+            int bad = runCheck(optarg);
+            if (bad < 0) fprintf(stderr, "no check named %s, see native/checks.cpp\n", optarg);
+            return bad != 0;
+        }
+        case 'q': quiet = true; break;
+        default: fprintf(stderr, "see native/native.cpp for usage\n"); return 1;
+        }
+    }
+    if (rxBatchMs > 0 && !(rxFormat & 1)) {
+        fprintf(stderr, "batching stats need JSON output (-f 1 or -f 3)\n");
+        return 1;
+    }
+    if (!replay.empty()) {
+        numPkts = 0;
+        const uint8_t *p = replay.data(), *end = p + replay.size();
+        while (captureNext(p, end)) numPkts++;
+    }
+    peers.resize(numGW > 1 ? numGW-1 : 0);
+    for (size_t i=0; i<peers.size(); i++) {
+        snprintf(peers[i].name, sizeof(peers[i].name), "rfgw/peer%u", (unsigned)i+1);
+        peers[i].nrw = new NodeRegistryWorker(peers[i].name);
+        DedupCache<uint32_t, DEDUP_SLOTS> *d = peers[i].dedup = new DedupCache<uint32_t, DEDUP_SLOTS>();
+        peers[i].nrw->onPublished = [d](uint32_t node, uint16_t hash) {
+            d->peerPublished(node, hash);
+        };
+    }
+    FILE *out = stdout;
+    if (quiet) stdout = fopen("/dev/null", "w");
+
+    mqttClient.onPub = [](const char *topic, const char *payload, size_t len, uint16_t id,
+            bool dup) {
+        MemScope mem(MEM_OTHER); // the hooks' bookkeeping is not charged to the gateway
+        uint64_t now = esp_timer_get_time();
+        std::lock_guard<std::mutex> lk(mtx);
+        if (strncmp(topic, nrw.gwTopic, strlen(nrw.gwTopic)) == 0) {
+            gossipNum++;
+            gossipBytes += len;
+        }
+        if (capFile && strcmp(topic+mqTopicLen, "/capture") == 0) fwrite(payload, 1, len, capFile);
+        if (strcmp(topic+mqTopicLen, "/rxr") == 0) { receptions++; return; }
+        if (strcmp(topic+mqTopicLen, "/ota/status") == 0) { otaStatusMsg(payload, len); return; }
+        if (strncmp(topic, mqTopic, mqTopicLen) != 0 || strncmp(topic+mqTopicLen, "/rx", 3) != 0)
+            return;
+        if (id) pubAt[id] = now;
+        if (dup) { rexmits++; return; }
+        bool json = topic[mqTopicLen+3] == 0;
+        if (json && !peers.empty()) countCopies(payload, len);
+        if ((rxFormat & 1) && !json) return; // count the JSON messages if there are any
+        // count the records in the message, a batch holds several
+        int n = 1;
+        if (json) {
+            static const char rec[] = "{\"at\"";
+            const char *end = payload+len;
+            n = 0;
+            for (const char *p = payload; (p = std::search(p, end, rec, rec+5)) != end; p++) n++;
+        }
+        for (int i=0; i<n && !rxRead.empty(); i++) {
+            radioLat.push_back(rxRead.front() - rxInjected.front());
+            gwLat.push_back(now - rxRead.front());
+            rxInjected.pop_front();
+            rxRead.pop_front();
+        }
+        published += n;
+    };
+
+    rfNum = numRadios;
+    setup();
+    MemStats memSetup[MEM_NUM];
+    for (int i=0; i<MEM_NUM; i++) memSetup[i] = memAcct.get(i);
+    for (Peer &p : peers) p.nrw->setup();
+    for (int i=0; i<rfNum; i++) {
+        SX1276fsk &radio = *radios[i].sx;
+        radio.onReceive = [i](const SX1276fsk::Frame &f) {
+            MemScope mem(MEM_OTHER);
+            uint64_t now = esp_timer_get_time();
+            std::lock_guard<std::mutex> lk(mtx);
+            rxInjected.push_back(f.injectedUs);
+            rxRead.push_back(now);
+            radioLatBy[i].push_back(now - f.injectedUs);
+            if (!rxSeq[i].empty()) { curSeq = rxSeq[i].front(); rxSeq[i].pop_front(); }
+        };
+        radio.onSend = [](uint8_t hdr, const uint8_t *buf, int len) {
+            MemScope mem(MEM_OTHER);
+            std::lock_guard<std::mutex> lk(mtx);
+            pktAcks[curSeq]++;
+        };
+    }
+    mqttClient.onPublish([](uint16_t id) {
+        MemScope mem(MEM_OTHER);
+        uint64_t now = esp_timer_get_time();
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = pubAt.find(id);
+        if (it == pubAt.end()) return;
+        pubackLat.push_back(now - it->second);
+        pubAt.erase(it);
+    });
+    mqttClient.connect();
+
+    // the driver thread injects the packets and runs the broker, whose callbacks thus come from
+    // another task as with AsyncTCP on the ESP32, while this thread runs loop(), which sleeps
+    // until it gets woken up
+    uint64_t t0 = esp_timer_get_time(), elapsed = 0;
+    int injected = 0;
+    uint32_t logRecovered = flashLog.pending;
+    std::atomic<bool> done(false);
+    std::thread driver([&] {
+        uint8_t buf[64];
+        uint64_t next = t0;
+        const uint8_t *rp = replay.data(), *rend = rp + replay.size();
+        const CaptureRecord *rec = captureNext(rp, rend);
+        uint64_t recT0 = rec ? captureUs(rec) : 0;
+        while (true) {
+            uint64_t now = esp_timer_get_time();
+            bool idle = true;
+            if (injected == outFrom && mqttClient.connected()) mqttClient.disconnect();
+            if (injected == outTo && !mqttClient.connected()) mqttClient.connect();
+            // pick the radio that receives the next frame
+            int r = injected % rfNum;
+            if (hotPct > 0 && rfNum > 1)
+                r = (uint32_t)(injected*2654435769u) % 100 < (uint32_t)hotPct ? 0 : 1 + injected % (rfNum-1);
+            SX1276fsk &radio = *radios[r].sx;
+            if (rec && now >= next && radio.pending() < 4) {
+                // replay the capture, pacing frames according to their reception timestamps
+                struct timeval at;
+                at.tv_sec = rec->sec;
+                at.tv_usec = rec->usec;
+                radio.inject(rec->data, rec->len, at, rec->rssi, rec->margin, rec->afc);
+                injected++;
+                idle = false;
+                rec = captureNext(rp, rend);
+                if (rec) next = speed > 0 ? t0 + (captureUs(rec) - recT0)/speed : now;
+            } else if (!rec && injected < numPkts && now >= next && radio.pending() < 4) {
+                uint32_t node = 0x1000 + injected % numNodes;
+                if (!peers.empty()) {
+                    { std::lock_guard<std::mutex> lk(mtx); rxSeq[r].push_back(injected); }
+                    int len = makeFrame(buf, node, injected);
+                    radio.inject(buf, len, 120, simMargin(0, node));
+                    peersHear(node, injected, buf, len);
+                } else {
+                    radio.inject(buf, makeFrame(buf, node, injected));
+                }
+                injected++;
+                idle = false;
+                next = rate > 0 ? t0 + (uint64_t)injected*1000000/rate : now;
+            }
+            if (otaSend(now)) idle = false;
+            peersLoop();
+            mqttClient.loop();
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                if (injected == numPkts && (int)(published + dedup.suppressed) >= numPkts &&
+                        dedup.numHeld == 0 && flashLog.pending == 0 &&
+                        (otaImage.empty() || otaDone)) break;
+                uint64_t last = std::max(next, otaSentAt);
+                if (injected == numPkts && (int64_t)(now - last) > 5000000) break; // give up
+            }
+            if (idle) std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        elapsed = esp_timer_get_time() - t0;
+        done = true;
+        loopWake();
+    });
+    // the scraper thread stands in for the web server's task
+    LogHistogram scrapeLat;
+    std::string scraped;
+    std::thread scraper([&] {
+        while (scrapeMs > 0 && !done) {
+            uint64_t t = esp_timer_get_time();
+            scraped = webServer.get("/metrics");
+            scrapeLat.record(esp_timer_get_time() - t);
+            std::this_thread::sleep_for(std::chrono::milliseconds(scrapeMs));
+        }
+    });
+    while (!done) loop();
+    driver.join();
+    scraper.join();
+
+    fprintf(out, "Injected %d packets, published %u, %u retransmits in %.3fs: %.0f packets/sec\n",
+            injected, published, rexmits, elapsed/1e6, published*1e6/elapsed);
+    fprintf(out, "MQTT publishes: %u, %u bytes\n", mqttClient.pubNum, mqttClient.pubBytes);
+    fprintf(out, "Backlog drain: %u packets at up to %u/s, max %d in flight\n", drainNum,
+            drainPps, inFlightMax);
+    if (nativeFlashWrites || logRecovered)
+        fprintf(out, "Flash log: %u recovered, %u logged, %u replayed, %u pending, %u dropped, "
+                "%u corrupt; %u writes, %u erases\n", logRecovered, flashLog.appended,
+                flashLog.replayed, flashLog.pending, flashLog.dropped, flashLog.corrupt,
+                nativeFlashWrites, nativeFlashErases);
+    if (!peers.empty()) {
+        fprintf(out, "Gossip: %u msgs %u bytes from %d gateways, %.2fus/pkt handling per gateway\n",
+                gossipNum, gossipBytes, numGW, (double)mqttClient.echoUs/numGW/injected);
+        int coll = 0, missed = 0;
+        for (int seq=0; seq<injected; seq++) {
+            int n = pktAcks.count(seq) ? pktAcks[seq] : 0;
+            if (n > 1) coll++;
+            if (n == 0) missed++;
+        }
+        fprintf(out, "ACKs: %.1f%% collisions, %.1f%% missed; gateway's estimate: "
+                "%u collisions, %u missed\n", injected ? 100.0*coll/injected : 0,
+                injected ? 100.0*missed/injected : 0, nrw.registry.ackCollisions,
+                nrw.registry.ackMissed);
+        int total = 0, lost = 0, dups = 0;
+        for (int seq=0; seq<injected; seq++) {
+            int n = copies.count(seq) ? copies[seq] : 0;
+            total += n;
+            if (n == 0) lost++;
+            if (n > 1) dups++;
+        }
+        fprintf(out, "Uplink: %.2f copies/packet, %.1f%% published more than once, %d lost; "
+                "%u reception records; gateway held %u, suppressed %u, timed out %u\n",
+                injected ? (double)total/injected : 0, injected ? 100.0*dups/injected : 0, lost,
+                receptions, dedup.holds, dedup.suppressed, dedup.timeouts);
+    }
+    if (!otaImage.empty()) {
+        std::vector<uint8_t> flash(otaImage.size());
+        const esp_partition_t *part = esp_ota_get_next_update_partition(0);
+        esp_partition_read(part, 0, flash.data(), flash.size());
+        fprintf(out, "OTA: %uKB image, %u chunks sent in %.2fs, flash %s the image, boot partition "
+                "%sset, %u restarts; status %s\n", (uint32_t)otaImage.size()/1024, otaSent,
+                (otaSentAt-otaStartAt)/1e6, flash == otaImage ? "matches" : "DIFFERS FROM",
+                nativeBootPartition ? "" : "NOT ", ESP.restarts, otaStatus.c_str());
+    }
+    fprintf(out, "Event log: %u events, %u dropped\n", evlog.written, evlog.dropped);
+    fprintf(out, "loop(): p50 %uus  p99 %uus  max %uus  (%u iterations), vBatt %umV sampled in %uus\n",
+            loopLatency.percentile(50), loopLatency.percentile(99), loopLatency.max,
+            loopLatency.n, vBatt, vBattUs);
+    fprintf(out, "loop() idle %.1f%%, wake-up latency: p50 %uus  p99 %uus  max %uus  (%u wake-ups)\n",
+            100.0*loopIdleUs/elapsed, wakeLatency.percentile(50), wakeLatency.percentile(99),
+            wakeLatency.max, wakeLatency.n);
+    // heap use per subsystem, memory still held at the end that wasn't held after setup() hints
+    // at a leak; note that the fake radio and broker allocate too, in the task calling them
+    fprintf(out, "Heap:");
+    for (int i=0; i<MEM_NUM; i++) {
+        MemStats m = memAcct.get(i);
+        fprintf(out, " %s %u allocs, max %uB%s", memTagName[i], m.allocs - memSetup[i].allocs,
+                m.highWater, i < MEM_NUM-1 ? ";" : "\n");
+    }
+    fprintf(out, "Heap growth since setup:");
+    for (int i=0; i<MEM_NUM; i++) {
+        MemStats m = memAcct.get(i);
+        fprintf(out, " %s %+d allocs %+dB%s", memTagName[i], (int)(m.live - memSetup[i].live),
+                (int)(m.bytes - memSetup[i].bytes), i < MEM_NUM-1 ? ";" : "\n");
+    }
+    fprintf(out, "ACK latency: p50 %uus  p99 %uus  max %uus  (%u ACKs, %u late)\n",
+            ackLatency.percentile(50), ackLatency.percentile(99), ackLatency.max, ackLatency.n,
+            ackLate);
+    if (scrapeMs > 0)
+        fprintf(out, "Metrics: %u scrapes of %d bytes, handler p50 %uus  p99 %uus  max %uus, "
+                "%u retries\n", scrapeLat.n, (int)scraped.size(), scrapeLat.percentile(50),
+                scrapeLat.percentile(99), scrapeLat.max, metricsRetries);
+    stdout = out;
+    if (capFile) fclose(capFile);
+    printLat("radio", radioLat);
+    printLat("gateway", gwLat);
+    printLat("puback", pubackLat);
+    if (rfNum > 1) {
+        for (int i=0; i<rfNum; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "radio%d", i);
+            printf("  %s: %u received, %u ACKs sent\n", name, radios[i].rxNum, radios[i].txNum);
+            printLat(name, radioLatBy[i]);
+        }
+    }
+#if PKT_TIMING
+    // the gateway's own per-stage histograms, see timing.h
+    PktTiming &t = pktTiming;
+    const char *names[] = {
+        "radio", "ack", "decode", "ring", "publish", "puback", "rexmit", "total" };
+    LogHistogram *h[] = {
+        &t.radio, &t.ack, &t.decode, &t.ring, &t.publish, &t.puback, &t.rexmit, &t.total };
+    printf("Stage latencies (PKT_TIMING):\n");
+    for (int i=0; i<8; i++)
+        printf("  %-8s p50 %6uus  p90 %6uus  p99 %6uus  max %6uus  (%u samples)\n", names[i],
+                h[i]->percentile(50), h[i]->percentile(90), h[i]->percentile(99), h[i]->max,
+                h[i]->n);
+#endif
+    if (scrapeMs > 0) printf("%s", scraped.c_str());
+    return 0;
+}
@@ -0,0 +1,148 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// OtaWriter streams a firmware image received over MQTT into the update partition. The image is
+// published in chunks on <topic>/ota/chunk, each message being an OtaChunk header followed by up
+// to OTA_CHUNK_SIZE bytes of the image. AsyncMqttClient hands a message over in fragments as its
+// TCP segments arrive and each fragment is written straight to flash, so neither the client nor
+// the gateway buffer a chunk, let alone the image. Chunks start on a flash sector, which is
+// erased when the chunk's header arrives, and once complete a chunk is read back and checked
+// against its CRC. A bad chunk, or one that isn't the next one expected, leaves the progress
+// unchanged. After each chunk the gateway publishes its progress on <topic>/ota/status, the
+// sender continues from the offset reported there, which also resumes the update after a
+// disconnection. See otaMessage in main.cpp.
+// OtaWriter is not thread-safe, fragment() is called from the MQTT client's task only.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <esp_partition.h>
+#include "flashlog.h" // crc32
+#include "evlog.h"
+
+#define OTA_MAGIC 0x3141544f // "OTA1" little-endian
+#define OTA_CHUNK_SIZE SPI_FLASH_SEC_SIZE
+
+struct __attribute__((packed)) OtaChunk {
+    uint32_t magic;
+    uint32_t imageId;           // identifies the image, e.g. its CRC32, a new ID restarts the update
+    uint32_t imageSize;
+    uint32_t offset;            // of the chunk's data in the image, a multiple of OTA_CHUNK_SIZE
+    uint32_t crc;               // CRC32 of the chunk's data
+};
+
+enum { OTA_IDLE, OTA_RUNNING, OTA_DONE, OTA_FAILED };
+
+class OtaWriter {
+public:
+    void begin(const esp_partition_t *p) { part = p; }
+
+    // fragment processes a fragment of a chunk message, it returns true at the end of the
+    // message, when the progress is to be reported
+    bool fragment(const uint8_t *p, size_t len, size_t index, size_t total) {
+        if (index == 0) {
+            hdrLen = 0;
+            accept = false;
+        }
+        // the header may be split across fragments
+        if (hdrLen < sizeof(hdr)) {
+            size_t n = len < sizeof(hdr)-hdrLen ? len : sizeof(hdr)-hdrLen;
+            memcpy((uint8_t *)&hdr + hdrLen, p, n);
+            hdrLen += n;
+            p += n;
+            len -= n;
+            index += n;
+            if (hdrLen == sizeof(hdr)) accept = startChunk(total);
+        }
+        if (accept && len > 0 &&
+                esp_partition_write(part, hdr.offset + index - sizeof(hdr), p, len) != ESP_OK) {
+            EVLOG(EV_OTA_BAD, hdr.offset);
+            bad++;
+            accept = false;
+        }
+        if (index + len < total) return false;
+        if (accept) endChunk();
+        return true;
+    }
+
+    // fail aborts the update, e.g. when the complete image doesn't validate
+    void fail() { state = OTA_FAILED; }
+
+    const esp_partition_t *part = 0;
+    uint8_t state = OTA_IDLE;
+    uint32_t imageId = 0, imageSize = 0;
+    uint32_t next = 0;          // bytes of the image written and checked
+    uint32_t startedAt = 0;     // millis when the first chunk arrived
+    uint32_t updates = 0;       // updates started
+    uint32_t chunks = 0;        // chunks written
+    uint32_t bad = 0;           // chunks that failed their CRC check or couldn't be written
+    uint32_t skipped = 0;       // duplicate or out of order chunks
+
+private:
+    // startChunk checks a chunk's header and erases its sector, it returns false if the chunk's
+    // data is to be ignored
+    bool startChunk(size_t total) {
+        uint32_t left = hdr.imageSize > hdr.offset ? hdr.imageSize - hdr.offset : 0;
+        uint32_t dataLen = left < OTA_CHUNK_SIZE ? left : OTA_CHUNK_SIZE;
+        if (!part || hdr.magic != OTA_MAGIC || hdr.imageSize > part->size ||
+                hdr.offset % OTA_CHUNK_SIZE != 0 || dataLen == 0 || total != sizeof(hdr)+dataLen) {
+            EVLOG(EV_OTA_BAD, hdr.offset);
+            bad++;
+            return false;
+        }
+        if (state != OTA_RUNNING || hdr.imageId != imageId) {
+            // only the first chunk may start an update, the status tells the sender to start over
+            if (hdr.offset != 0) {
+                skipped++;
+                return false;
+            }
+            printf("OTA: receiving image %08x of %u bytes into %s\n", hdr.imageId,
+                    hdr.imageSize, part->label);
+            state = OTA_RUNNING;
+            imageId = hdr.imageId;
+            imageSize = hdr.imageSize;
+            next = 0;
+            startedAt = millis();
+            updates++;
+            chunks = bad = skipped = 0;
+        }
+        if (hdr.offset != next) {
+            EVLOG(EV_OTA_SKIP, hdr.offset, next);
+            skipped++;
+            return false;
+        }
+        if (esp_partition_erase_range(part, hdr.offset, OTA_CHUNK_SIZE) != ESP_OK) {
+            EVLOG(EV_OTA_BAD, hdr.offset);
+            bad++;
+            return false;
+        }
+        chunkLen = dataLen;
+        return true;
+    }
+
+    // endChunk reads the chunk back and advances if it made it to flash intact
+    void endChunk() {
+        uint8_t buf[256];
+        uint32_t crc = 0;
+        for (uint32_t off=0; off<chunkLen; off+=sizeof(buf)) {
+            uint32_t n = chunkLen-off < sizeof(buf) ? chunkLen-off : sizeof(buf);
+            if (esp_partition_read(part, hdr.offset+off, buf, n) != ESP_OK) break;
+            crc = crc32(crc, buf, n);
+        }
+        if (crc != hdr.crc) {
+            EVLOG(EV_OTA_BAD, hdr.offset);
+            bad++;
+            return;
+        }
+        next += chunkLen;
+        chunks++;
+        if (next == imageSize) state = OTA_DONE;
+    }
+
+    OtaChunk hdr;
+    size_t hdrLen = 0;          // bytes of hdr received
+    bool accept = false;        // the current chunk's data is being written
+    uint32_t chunkLen;          // length of the current chunk's data
+};
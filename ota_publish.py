@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# ESP32 FSK Radio to MQTT gateway
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Streams a firmware image to a gateway in chunks over MQTT, see ota.h. Each chunk is published on
+# <topic>/ota/chunk and the next one is sent once the gateway's <topic>/ota/status acknowledges
+# it, continuing from the offset the gateway reports. Restarting the script after an
+# interruption thus resumes the update where it left off, as long as the gateway hasn't rebooted.
+#
+# Usage: ota_publish.py <broker> <topic> <firmware.bin>   e.g. ota_publish.py mqtt rfgw/house \
+#            .pio/build/rfgw2_ota/firmware.bin
+# Requires paho-mqtt.
+
+import json
+import struct
+import sys
+import threading
+import time
+import zlib
+
+import paho.mqtt.client as mqtt
+
+OTA_MAGIC = 0x3141544f
+CHUNK_SIZE = 4096
+TIMEOUT = 10  # seconds to wait for the status after sending a chunk
+
+
+def main(broker, topic, path):
+    image = open(path, "rb").read()
+    image_id = zlib.crc32(image)
+    status = {}
+    changed = threading.Condition()
+
+    def on_connect(client, userdata, flags, rc):
+        client.subscribe(topic + "/ota/status", 1)
+
+    def on_message(client, userdata, msg):
+        with changed:
+            status.clear()
+            status.update(json.loads(msg.payload))
+            changed.notify()
+
+    client = mqtt.Client()
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(broker)
+    client.loop_start()
+
+    # the retained status tells where a previous attempt left off
+    with changed:
+        changed.wait(2)
+    start = time.time()
+    while True:
+        with changed:
+            running = status.get("id") == image_id and status.get("state") in ("running", "done")
+            off = status.get("next", 0) if running else 0
+            if running and status.get("state") == "done":
+                break
+            status.clear()
+        data = image[off:off+CHUNK_SIZE]
+        hdr = struct.pack("<5I", OTA_MAGIC, image_id, len(image), off, zlib.crc32(data))
+        client.publish(topic + "/ota/chunk", hdr + data, qos=1)
+        with changed:
+            if not changed.wait(TIMEOUT):
+                print("No status from the gateway, resending chunk at %d" % off)
+                continue
+        if status.get("state") == "failed":
+            sys.exit("Update failed: %s" % json.dumps(status))
+        print("\r%d/%d bytes" % (status.get("next", 0), len(image)), end="", flush=True)
+
+    print("\nDone in %.1fs: %s" % (time.time() - start, json.dumps(status)))
+    client.loop_stop()
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        sys.exit("Usage: ota_publish.py <broker> <topic> <firmware.bin>")
+    main(*sys.argv[1:])
@@ -0,0 +1,226 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// PacketQueue holds packets that have been handed to MQTT until they are acknowledged, as well
+// as packets that are waiting for MQTT to connect. It has a fixed capacity and all operations
+// are O(1) regardless of how many packets are queued:
+// - packets are found by MQTT message id via a small chained hash table,
+// - retransmit deadlines are kept in a hashed timer wheel, packets that are due move to an
+//   expired list kept in arrival order so the backlog after an outage drains oldest first
+//   (inserting is O(1) as long as packets expire in about the order in which they arrived),
+// - packets are kept in a list in the order in which they were queued so that when the queue
+//   is full the oldest packet is evicted.
+// The queue does not lock, the caller must serialize access.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef PKT_QUEUE_SIZE
+#define PKT_QUEUE_SIZE 100
+#endif
+
+class PacketQueue {
+public:
+    static const int CAP = PKT_QUEUE_SIZE;
+    static const int HASH_SIZE = 256;   // power of 2, >= 2*CAP keeps chains short
+    static const int WHEEL_SIZE = 64;   // power of 2
+    static const int TICK_MS = 32;      // WHEEL_SIZE*TICK_MS should exceed typical timeouts
+
+    PacketQueue() {
+        for (int i=0; i<HASH_SIZE; i++) hash[i] = NIL;
+        for (int i=0; i<WHEEL_SIZE; i++) wheel[i] = wheelTail[i] = NIL;
+        for (int i=0; i<CAP; i++) {
+            slots[i].id = 0;
+            slots[i].next = i+1 < CAP ? i+1 : NIL;
+        }
+        freeHead = 0;
+    }
+
+    // push queues a packet published with MQTT message id (0 if not published) that is due for
+    // retransmission at deadline (millis). If the queue is full the oldest packet is evicted and
+    // returned so the caller can free it, else push returns NULL.
+    jlPacket *push(jlPacket *pkt, uint16_t id, uint32_t deadline) {
+        jlPacket *evicted = 0;
+        if (freeHead == NIL) {
+            int s = oldest;
+            evicted = slots[s].pkt;
+            unlink(s);
+            evictions++;
+        }
+        int s = freeHead;
+        Slot &sl = slots[s];
+        freeHead = sl.next;
+        sl.pkt = pkt;
+        sl.seq = pushSeq++;
+        // append to the age list
+        sl.prev = newest;
+        sl.next = NIL;
+        if (newest != NIL) slots[newest].next = s; else oldest = s;
+        newest = s;
+        num++;
+        update(s, id, deadline);
+        return evicted;
+    }
+
+    // remove dequeues the packet with the given MQTT message id and returns it, or NULL
+    jlPacket *remove(uint16_t id) {
+        if (id == 0) return 0;
+        for (int s = hash[id & (HASH_SIZE-1)]; s != NIL; s = slots[s].hnext) {
+            if (slots[s].id == id) {
+                jlPacket *pkt = slots[s].pkt;
+                unlink(s);
+                return pkt;
+            }
+        }
+        return 0;
+    }
+
+    // removeAt dequeues the packet in the given slot and returns it
+    jlPacket *removeAt(int s) {
+        jlPacket *pkt = slots[s].pkt;
+        unlink(s);
+        return pkt;
+    }
+
+    // nextDue returns the slot of a packet whose deadline has passed, or -1. The packet stays
+    // queued but is disarmed until the caller re-arms it using update().
+    int nextDue(uint32_t now) {
+        advance(now);
+        int s = expHead;
+        if (s == NIL) return -1;
+        timerUnlink(s);
+        if (slots[s].id != 0) hashUnlink(s);
+        slots[s].id = 0;
+        return s;
+    }
+
+    // update sets the MQTT message id and retransmit deadline of a queued packet
+    void update(int s, uint16_t id, uint32_t deadline) {
+        Slot &sl = slots[s];
+        if (sl.where != NONE) timerUnlink(s);
+        if (sl.id != 0) hashUnlink(s);
+        sl.id = id;
+        sl.deadline = deadline;
+        if (id != 0) {
+            int h = id & (HASH_SIZE-1);
+            sl.hnext = hash[h];
+            hash[h] = s;
+        }
+        if ((int32_t)(deadline - curTick*TICK_MS) < 0) {
+            expire(s); // already due
+        } else {
+            int b = (deadline/TICK_MS) & (WHEEL_SIZE-1);
+            sl.where = b;
+            if (id != 0) flying++;
+            // append to the bucket so packets expire in the order in which they were armed
+            sl.tnext = NIL;
+            sl.tprev = wheelTail[b];
+            if (wheelTail[b] != NIL) slots[wheelTail[b]].tnext = s; else wheel[b] = s;
+            wheelTail[b] = s;
+        }
+    }
+
+    jlPacket *packet(int s) { return slots[s].pkt; }
+    uint16_t id(int s) { return slots[s].id; }
+    int size() { return num; }
+    int inFlight() { return flying; }   // packets published and waiting for their PUBACK
+    int due() { return numExpired; }    // packets waiting to be (re)transmitted, as of nextDue
+
+    uint32_t evictions = 0;     // packets dropped because the queue was full
+
+private:
+    static const int16_t NIL = -1;
+    static const int8_t NONE = -1, EXPIRED = -2;
+
+    struct Slot {
+        jlPacket *pkt;
+        uint32_t deadline;      // retransmit deadline in millis
+        uint32_t seq;           // arrival order
+        uint16_t id;            // MQTT message id, 0 if none
+        int16_t prev, next;     // age list, next also links the free list
+        int16_t hnext;          // hash chain
+        int16_t tprev, tnext;   // timer wheel bucket or expired list
+        int8_t where = NONE;    // timer wheel bucket, EXPIRED, or NONE
+    };
+
+    // advance moves packets whose deadline has passed from the wheel to the expired list. It
+    // visits each bucket at most once per call, so the cost depends on elapsed time, not on
+    // the number of queued packets.
+    void advance(uint32_t now) {
+        uint32_t nowTick = now/TICK_MS;
+        int n = nowTick - curTick + 1;
+        if (n > WHEEL_SIZE) n = WHEEL_SIZE;
+        for (int i=0; i<n; i++) {
+            int b = (curTick+i) & (WHEEL_SIZE-1);
+            for (int s = wheel[b]; s != NIL; ) {
+                int nx = slots[s].tnext;
+                if ((int32_t)(now - slots[s].deadline) >= 0) {
+                    timerUnlink(s);
+                    expire(s);
+                }
+                s = nx;
+            }
+        }
+        curTick = nowTick; // the current tick's bucket is rescanned next time
+    }
+
+    // expire inserts a slot into the expired list in arrival order. Packets mostly expire in the
+    // order in which they arrived, so the insertion point is found at or near the tail.
+    void expire(int s) {
+        Slot &sl = slots[s];
+        sl.where = EXPIRED;
+        int p = expTail;
+        while (p != NIL && (int32_t)(slots[p].seq - sl.seq) > 0) p = slots[p].tprev;
+        sl.tprev = p;
+        sl.tnext = p != NIL ? slots[p].tnext : expHead;
+        if (p != NIL) slots[p].tnext = s; else expHead = s;
+        if (sl.tnext != NIL) slots[sl.tnext].tprev = s; else expTail = s;
+        numExpired++;
+    }
+
+    void timerUnlink(int s) {
+        Slot &sl = slots[s];
+        if (sl.where == EXPIRED) {
+            if (sl.tprev != NIL) slots[sl.tprev].tnext = sl.tnext; else expHead = sl.tnext;
+            if (sl.tnext != NIL) slots[sl.tnext].tprev = sl.tprev; else expTail = sl.tprev;
+            numExpired--;
+        } else if (sl.where != NONE) {
+            if (sl.id != 0) flying--;
+            if (sl.tprev != NIL) slots[sl.tprev].tnext = sl.tnext; else wheel[sl.where] = sl.tnext;
+            if (sl.tnext != NIL) slots[sl.tnext].tprev = sl.tprev; else wheelTail[sl.where] = sl.tprev;
+        }
+        sl.where = NONE;
+    }
+
+    void hashUnlink(int s) {
+        int16_t *p = &hash[slots[s].id & (HASH_SIZE-1)];
+        while (*p != NIL && *p != s) p = &slots[*p].hnext;
+        if (*p == s) *p = slots[s].hnext;
+    }
+
+    // unlink removes a slot from all lists and returns it to the free list
+    void unlink(int s) {
+        Slot &sl = slots[s];
+        timerUnlink(s);
+        if (sl.id != 0) hashUnlink(s);
+        sl.id = 0;
+        if (sl.prev != NIL) slots[sl.prev].next = sl.next; else oldest = sl.next;
+        if (sl.next != NIL) slots[sl.next].prev = sl.prev; else newest = sl.prev;
+        sl.pkt = 0;
+        sl.next = freeHead;
+        freeHead = s;
+        num--;
+    }
+
+    Slot slots[CAP];
+    int16_t hash[HASH_SIZE];
+    int16_t wheel[WHEEL_SIZE], wheelTail[WHEEL_SIZE];
+    int16_t expHead = NIL, expTail = NIL;
+    int16_t oldest = NIL, newest = NIL, freeHead;
+    uint32_t curTick = 0;
+    uint32_t pushSeq = 0;
+    int num = 0;
+    int flying = 0;             // slots in the wheel with an MQTT message id
+    int numExpired = 0;
+};
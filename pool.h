@@ -0,0 +1,81 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// SlabPool is a fixed-size pool of equally sized slots that are preallocated statically.
+// It replaces per-packet calloc/free so the heap doesn't fragment under sustained traffic.
+// Alloc and free are O(1) using a stack of free slot indexes and are safe to call from
+// different tasks (e.g. the radio task allocating and the MQTT callback freeing).
+// Freeing a slot twice, or a pointer that isn't a slot, would hand the slot out twice, which is
+// caught by an in-use flag per slot.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+template <typename T, int SLOT_SIZE, int NUM_SLOTS>
+class SlabPool {
+public:
+    SlabPool() {
+        for (int i=0; i<NUM_SLOTS; i++) freeList[i] = NUM_SLOTS-1-i;
+        numFree = NUM_SLOTS;
+    }
+
+    // alloc returns a zeroed slot, or NULL if the pool is exhausted
+    T *alloc() {
+        portENTER_CRITICAL(&mux);
+        if (numFree == 0) {
+            fails++;
+            portEXIT_CRITICAL(&mux);
+            return 0;
+        }
+        int ix = freeList[--numFree];
+        used[ix] = true;
+        allocs++;
+        if (NUM_SLOTS-numFree > highWater) highWater = NUM_SLOTS-numFree;
+        portEXIT_CRITICAL(&mux);
+        memset(slabs[ix], 0, sizeof(slabs[ix]));
+        return (T *)slabs[ix];
+    }
+
+    // free returns a slot to the pool, NULL is ignored. Freeing a pointer that doesn't belong to
+    // the pool or a slot that is already free is counted in badFrees and asserts, the pool is
+    // left unchanged.
+    void free(T *p) {
+        if (!p) return;
+        int ix = index(p);
+        portENTER_CRITICAL(&mux);
+        bool ok = ix >= 0 && used[ix];
+        if (ok) {
+            used[ix] = false;
+            freeList[numFree++] = ix;
+        } else {
+            badFrees++;
+        }
+        portEXIT_CRITICAL(&mux);
+        assert(ok && "SlabPool: double free or foreign pointer");
+    }
+
+    int inUse() { return NUM_SLOTS - numFree; }
+    int available() { return numFree; }
+    int size() { return NUM_SLOTS; }
+
+    uint32_t allocs = 0;    // number of successful allocations
+    uint32_t fails = 0;     // number of allocations that failed due to exhaustion
+    int highWater = 0;      // max number of slots in use at any point in time
+    uint32_t badFrees = 0;  // frees of a free slot or of a pointer not in the pool
+
+private:
+    int index(T *p) {
+        uintptr_t off = (uintptr_t)p - (uintptr_t)slabs;
+        if (!p || off >= sizeof(slabs) || off % sizeof(slabs[0]) != 0) return -1;
+        return off / sizeof(slabs[0]);
+    }
+
+    uint32_t slabs[NUM_SLOTS][(SLOT_SIZE+3)/4]; // 32-bit aligned slots
+    int16_t freeList[NUM_SLOTS];                // stack of free slot indexes
+    bool used[NUM_SLOTS] = {};                  // slot is allocated
+    int numFree;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
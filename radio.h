@@ -0,0 +1,73 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// A gateway can have several SX1276 radios on the shared SPI bus, each with its own chip
+// select, reset and interrupt pins and listening on its own frequency and/or group. Packets
+// from all radios feed the same decode, de-duplication and publish pipeline. The radio task
+// services the radios round-robin, one packet each per pass, so a busy channel cannot starve
+// the others, and only one radio uses the SPI bus at a time.
+
+#pragma once
+
+#include <stdint.h>
+#include <SPI.h>
+#include <SX1276fsk.h>
+
+#define RADIO_FIFO_MAX 63 // max frame length written to the 64-byte FIFO after the length byte
+
+// RadioConfig describes a radio module, a freq or group of 0 selects the gateway's default
+struct RadioConfig {
+    int8_t ss, reset, dio0, dio4;
+    uint32_t freq;
+    uint8_t group;
+};
+
+class Radio {
+public:
+    // begin initializes the radio and puts it into standby
+    void begin(SPIClass &spi, int idx, const RadioConfig &c, uint8_t id, uint8_t defGroup,
+            uint32_t defFreq, int8_t pow)
+    {
+        index = idx;
+        this->spi = &spi;
+        ss = c.ss;
+        freq = c.freq ? c.freq : defFreq;
+        group = c.group ? c.group : defGroup;
+        sx = new SX1276fsk(spi, c.ss, c.reset);
+        sx->init(id, group, freq);
+        sx->setIntrPins(c.dio0, c.dio4);
+        sx->txPower(pow);
+        sx->setMode(SX1276fsk::MODE_STANDBY);
+        spiHz = spiClockDivToFrequency(spi.getClockDivider()); // as configured by the driver
+    }
+
+    // sendRaw transmits a frame as-is. SX1276fsk::send() prepends the v1 destination and source
+    // bytes, which v2 frames don't have, so the length-prefixed frame is written to the FIFO
+    // directly and then sent by switching the library to TX, as send() does; receive() switches
+    // back to RX once the packet has gone out. The FIFO write is an SPI transaction like the
+    // driver's own register accesses: beginTransaction takes the bus lock of the SPIClass the
+    // driver shares, and the clock is the one the driver configured, see begin().
+    bool sendRaw(const uint8_t *buf, int len) {
+        if (len <= 0 || len > RADIO_FIFO_MAX) return false;
+        sx->setMode(SX1276fsk::MODE_STANDBY);
+        spi->beginTransaction(SPISettings(spiHz, MSBFIRST, SPI_MODE0));
+        digitalWrite(ss, LOW);
+        spi->transfer(0x00 | 0x80); // RegFifo, write access
+        spi->transfer(len);
+        for (int i=0; i<len; i++) spi->transfer(buf[i]);
+        digitalWrite(ss, HIGH);
+        spi->endTransaction();
+        sx->setMode(SX1276fsk::MODE_TRANSMIT);
+        return true;
+    }
+
+    SX1276fsk *sx = 0;
+    SPIClass *spi = 0;
+    uint32_t spiHz;             // SPI clock used by the driver
+    int8_t ss;
+    uint8_t index;
+    uint8_t group;
+    uint32_t freq;
+    uint32_t rxNum = 0;         // packets received
+    uint32_t txNum = 0;         // ACKs sent
+};
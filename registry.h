@@ -1,76 +1,416 @@
 // Registry to keep track of RF nodes and which GW is responsible for their packets
 
-#include <map>
+#include <mutex>
 #include <ArduinoJson.h>
 #include <functional>
+#include "evlog.h"
+#include "memacct.h"
 using namespace std::placeholders;
 
 #ifndef MAX_GW
 #define MAX_GW 10
 #endif
+#define GW_NAME_LEN 41 // max gateway name length incl. terminating null, longer names are truncated
+
+// MAX_NODES is the size of the node table, it must be a power of 2. The table holds up to
+// NODE_CAP nodes, keeping a quarter of the slots free so probe sequences stay short. Once it is
+// full the node heard from least recently is evicted, which is logged as an error since that node
+// may still be alive, see -T registry in native/checks.cpp. An entry takes 36 bytes, so the
+// default table takes 9KB of DRAM for 192 nodes, sites with more nodes can build with
+// -DMAX_NODES=1024, which takes 36KB for 768 nodes, as the native build does for its simulations.
+#ifndef MAX_NODES
+#define MAX_NODES 256
+#endif
+#define NODE_CAP (MAX_NODES - MAX_NODES/4)
+
+// Binary gossip: instead of publishing a JSON report per received packet (gossipBinary=0) a gateway
+// can collect its receptions and publish a summary on <gwTopic>b every few ms (gossipBinary=1).
+// A summary consists of a version byte, the length of the gateway name, the name, and packed
+// little-endian GossipEntry records, one per node heard since the previous summary.
+#define GOSSIP_VERSION 2
+#ifndef GOSSIP_MAX
+#define GOSSIP_MAX 64 // max entries per summary, a full summary is sent right away
+#endif
+#define GOSSIP_MARGIN_DELTA 3 // change in dB of the best margin that warrants an immediate summary
+#define GOSSIP_ACKED 0x01     // GossipEntry flag: this gateway ACKed the packet
+
+struct __attribute__((packed)) GossipEntry {
+    uint32_t node;
+    int8_t margin;
+    uint8_t flags;
+    uint16_t age;               // ms since the packet was received, saturates at 65535
+    uint16_t hash;              // dedupHash of the packet if this gateway published it, else 0
+};
+
+#define GOSSIP_MSG_MAX (2+GW_NAME_LEN+GOSSIP_MAX*sizeof(GossipEntry))
+
+// ACK modes: with ACK_REGISTRY a gateway ACKs if it reported the best margin for the node's
+// previous packets, or if no gateway is known to hear the node, which relies on its own reports
+// making the round-trip through the broker. With ACK_ARBITRATE each gateway compares its own best
+// margin, including the packet at hand, with the best margin reported by another gateway and
+// breaks ties using a hash of gateway name and node ID, so the decision is made locally.
+#define ACK_REGISTRY  0
+#define ACK_ARBITRATE 1
+#define ACK_MATCH_MS  200 // max time between receptions by different gws of the same packet
+
+// GossipSummary accumulates the receptions to be sent in the next binary summary. Packets from
+// the same node are collapsed into one entry with the most recent info.
+class GossipSummary {
+public:
+    // add records a reception, it returns false if the summary is full or already reports a
+    // packet from the node that this gateway published, which must not be overwritten
+    bool add(uint32_t node, int margin, bool acked, uint16_t hash, uint32_t now) {
+        int i = 0;
+        while (i < count && entries[i].node != node) i++;
+        if (i < count && entries[i].hash != 0) return false;
+        if (i == count) {
+            if (count == GOSSIP_MAX) return false;
+            if (count++ == 0) first = now;
+        }
+        GossipEntry &e = entries[i];
+        e.node = node;
+        e.margin = margin < -128 ? -128 : margin > 127 ? 127 : margin;
+        e.flags = acked ? GOSSIP_ACKED : 0;
+        e.hash = hash;
+        at[i] = now;
+        return true;
+    }
+
+    // encode writes the summary into buf and clears it, it returns the length or 0 if there was
+    // nothing to send or the buffer is too small
+    int encode(const char *gw, uint8_t *buf, int size, uint32_t now) {
+        int nameLen = strlen(gw);
+        if (nameLen >= GW_NAME_LEN) nameLen = GW_NAME_LEN-1;
+        int len = 2 + nameLen + count*sizeof(GossipEntry);
+        if (count == 0 || len > size) return 0;
+        buf[0] = GOSSIP_VERSION;
+        buf[1] = nameLen;
+        memcpy(buf+2, gw, nameLen);
+        for (int i=0; i<count; i++) {
+            uint32_t age = now - at[i];
+            entries[i].age = age > 0xffff ? 0xffff : age;
+        }
+        memcpy(buf+2+nameLen, entries, count*sizeof(GossipEntry));
+        count = 0;
+        return len;
+    }
+
+    int count = 0;
+    uint32_t first;             // millis when the first entry was added
+private:
+    GossipEntry entries[GOSSIP_MAX];
+    uint32_t at[GOSSIP_MAX];    // millis when each entry was last updated
+};
 
 class NodeRegistry {
 public:
 
     // shouldAck returns true if an ACK should be sent, false otherwise.
     // It essentially checks the margin info received from all the gw for the previous packet
-    bool shouldAck(uint32_t nodeId) {
-        NodeEntry &e = nodes[nodeId]; // note: [] creates entry if it doesn't exist
-        return e.gwId <= 0; // <0 => always reply to new nodes, may cause a collision...
+    // It is called from the radio task while addInfo is called from MQTT callbacks, hence the lock.
+    // Like the other queries it doesn't create an entry, entries are only created by the reports
+    // of the gateways, including this one's, so a node's first packets are always ACKed and not
+    // accounted for.
+    bool shouldAck(uint32_t nodeId, int snr, int mode) {
+        std::lock_guard<std::mutex> lock(mtx);
+        NodeEntry *p = find(nodeId);
+        if (!p) return true; // no entry => always reply to new nodes, may cause a collision...
+        NodeEntry &e = *p;
+        // account for the previous packet now that the other gws had time to report on it
+        if (e.rxAt != 0) {
+            if (e.acked && e.peerAcked) ackCollisions++;
+            if (!e.acked && !e.peerAcked) ackMissed++;
+        }
+        uint32_t now = millis();
+        e.seen = now;
+        if (e.rxAt == 0 || snr >= e.selfMargin || (int32_t)(now-e.selfAt) > (int32_t)entryTimeout) {
+            e.selfMargin = snr < -128 ? -128 : snr > 127 ? 127 : snr;
+            e.selfAt = now;
+        }
+        bool ack;
+        if (mode == ACK_ARBITRATE) {
+            ack = arbitrate(e);
+        } else {
+            ack = !gwValid(e) || e.gwId == 0;
+        }
+        e.rxAt = now | 1;
+        e.acked = ack;
+        e.peerAcked = e.peerAckAt != 0 && sameTime(e.peerAckAt, e.rxAt); // peer was faster
+        return ack;
     }
 
     // addInfo registers the margin info received from a gw.
     // It keeps track of the strongest signal, but replaces it if it is more than a few seconds old
     // in an attempt to keep track of only the last packet data.
-    void addInfo(uint32_t nodeId, const char *gw, int margin) {
+    void addInfo(uint32_t nodeId, const char *gw, int margin, uint32_t age = 0) {
+        std::lock_guard<std::mutex> lock(mtx);
+        update(nodeId, lookupGW(gw), margin, millis() - age, false);
+    }
+
+    // addAck registers that a gw ACKed a packet from the node
+    void addAck(uint32_t nodeId, const char *gw) {
+        std::lock_guard<std::mutex> lock(mtx);
         int gwId = lookupGW(gw);
-        NodeEntry &e = nodes[nodeId];
-        if (e.gwId < 0 || margin > e.margin || millis()-e.at > entryTimeout) {
-            e.gwId = gwId;
-            e.margin = margin;
-            e.at = millis();
-            if (debug) printf("Node %08x reachable via GW %d(%s) with %ddB\n",
-                    nodeId, gwId, gw, margin);
-        }
+        NodeEntry *e = find(nodeId);
+        if (e && gwId != 0) peerAck(*e, millis());
+    }
+
+    // addSummary registers all the entries of a binary gossip summary received from a gw
+    void addSummary(const char *gw, const GossipEntry *entries, int n) {
+        std::lock_guard<std::mutex> lock(mtx);
+        int gwId = lookupGW(gw);
+        uint32_t now = millis();
+        for (int i=0; i<n; i++)
+            update(entries[i].node, gwId, entries[i].margin, now - entries[i].age,
+                    entries[i].flags & GOSSIP_ACKED);
+    }
+
+    // isBest returns whether this gateway reported the best margin for the node's recent packets
+    // or no gateway is known to hear the node, i.e., whether it is designated to publish them
+    bool isBest(uint32_t nodeId) {
+        std::lock_guard<std::mutex> lock(mtx);
+        NodeEntry *e = find(nodeId);
+        return !e || !gwValid(*e) || e->gwId == 0 || millis() - e->at > entryTimeout;
+    }
+
+    // materialChange returns true if a margin measured by this gateway changes which gateway is
+    // best for the node or moves the best margin by GOSSIP_MARGIN_DELTA, i.e., whether the
+    // other gateways should hear about it right away.
+    bool materialChange(uint32_t nodeId, int margin) {
+        std::lock_guard<std::mutex> lock(mtx);
+        NodeEntry *e = find(nodeId);
+        if (!e || !gwValid(*e) || millis()-e->at > entryTimeout) return true;
+        if (e->gwId == 0) return abs(margin - e->margin) >= GOSSIP_MARGIN_DELTA;
+        return margin > e->margin;
     }
 
     bool debug = false;
 
 //private:
-    const char *gateways[MAX_GW];       // index 0 = self
+    // gateways interns the names of the gateways heard from, the index into the table is the
+    // gwId. When the table is full the gateway heard from least recently is replaced and the
+    // slot's generation is bumped so NodeEntry's referring to the old gateway become invalid.
+    struct GwEntry {
+        char name[GW_NAME_LEN];
+        uint32_t hash;                  // hash of the full name
+        uint32_t seen;                  // millis when last heard from
+        uint8_t gen;                    // incremented each time the slot is reused
+    };
+    GwEntry gateways[MAX_GW];           // index 0 = self
     int baz = 0xdeadbeef;
     int numGW;
+    uint32_t gwReplaced;                // number of gateway slots reused
+    uint32_t ackCollisions;             // packets ACKed by this gw and another one
+    uint32_t ackMissed;                 // packets heard but ACKed by no gw, as far as we know
     uint32_t entryTimeout;              // timeout for the top entry, in ms
 
+    // nodes is an open-addressed hash table with linear probing. Entries are removed with
+    // backward shifting, so an empty slot always ends a probe sequence.
     struct NodeEntry {
-        int16_t gwId;
-        int16_t margin;
+        uint32_t id;                    // node ID, 0 for an empty slot
         uint32_t at;
-        NodeEntry() : gwId(-1), margin(-100), at(millis()) {};
+        uint32_t seen;                  // millis when last heard of, for eviction
+        int8_t gwId;                    // gw with the best margin, may be self
+        int8_t margin;
+        uint8_t gwGen;                  // generation of the gateways[gwId] slot
+        // best other gw, for ACK_ARBITRATE
+        int8_t peerId;
+        int8_t peerMargin;
+        uint8_t peerGen;
+        int8_t selfMargin;              // this gw's best margin, like margin but without gossip
+        bool acked:1;                   // this gw ACKed the packet received at rxAt
+        bool peerAcked:1;               // another gw ACKed that packet
+        uint32_t peerAt;
+        uint32_t selfAt;
+        uint32_t rxAt;                  // millis when this gw last received from the node, 0: never
+        uint32_t peerAckAt;             // time of a peer ACK that didn't match rxAt
     };
-    std::map<uint32_t, NodeEntry> nodes;
+
+    // gwValid returns whether the entry refers to a gateway that is still in the table
+    bool gwValid(NodeEntry &e) {
+        return e.gwId >= 0 && gateways[e.gwId].gen == e.gwGen;
+    }
+    bool peerValid(NodeEntry &e) {
+        return e.peerId >= 0 && gateways[e.peerId].gen == e.peerGen;
+    }
+
+    NodeEntry nodes[MAX_NODES];
+    int numNodes;                       // number of slots in use
+    uint32_t evictions;                 // nodes evicted because the table was full
+    std::mutex mtx;
+
+    static constexpr int ilog2(uint32_t n) { return n <= 1 ? 0 : 1 + ilog2(n/2); }
+    static_assert((MAX_NODES & (MAX_NODES-1)) == 0 && MAX_NODES >= 4, "MAX_NODES must be a power of 2");
+
+    // hash returns the home slot of a node, Fibonacci hashing uses the top bits of the product
+    static int hash(uint32_t nodeId) {
+        return (nodeId * 2654435769u) >> (32 - ilog2(MAX_NODES));
+    }
+
+    // update records the margin info of a gw for a node, the lock must be held
+    void update(uint32_t nodeId, int gwId, int margin, uint32_t at, bool acked) {
+        NodeEntry &e = insert(nodeId);
+        e.seen = millis();
+        if (margin < -128) margin = -128;
+        if (margin > 127) margin = 127;
+        if (!gwValid(e) || margin > e.margin || (int32_t)(at-e.at) > (int32_t)entryTimeout) {
+            e.gwId = gwId;
+            e.gwGen = gateways[gwId].gen;
+            e.margin = margin;
+            e.at = at;
+            EVLOG(EV_NODE_GW, nodeId, gwId, margin);
+        }
+        if (gwId == 0) return;
+        // track the best other gw
+        if (!peerValid(e) || margin > e.peerMargin ||
+                (int32_t)(at-e.peerAt) > (int32_t)entryTimeout) {
+            e.peerId = gwId;
+            e.peerGen = gateways[gwId].gen;
+            e.peerMargin = margin;
+            e.peerAt = at;
+        }
+        if (acked) peerAck(e, at);
+    }
+
+    // peerAck records that another gw ACKed a packet it received at the given time, which may
+    // be the last packet this gw received or one it has yet to process
+    void peerAck(NodeEntry &e, uint32_t at) {
+        if (e.rxAt != 0 && sameTime(at, e.rxAt)) e.peerAcked = true;
+        else e.peerAckAt = at | 1;
+    }
+
+    static bool sameTime(uint32_t a, uint32_t b) {
+        int32_t dt = a - b;
+        return dt <= ACK_MATCH_MS && dt >= -ACK_MATCH_MS;
+    }
+
+    // arbitrate decides whether this gw ACKs the packet just received, see ACK_ARBITRATE.
+    // The lock must be held.
+    bool arbitrate(NodeEntry &e) {
+        if (!peerValid(e) || millis()-e.peerAt > entryTimeout) return true;
+        if (e.selfMargin != e.peerMargin) return e.selfMargin > e.peerMargin;
+        return tieBreak(0, e.id) > tieBreak(e.peerId, e.id);
+    }
+
+    uint32_t tieBreak(int gwId, uint32_t nodeId) {
+        return (gateways[gwId].hash ^ nodeId) * 2654435769u;
+    }
+
+    // find returns the entry for a node or NULL if there is none
+    NodeEntry *find(uint32_t nodeId) {
+        for (int i=hash(nodeId); ; i=(i+1) & (MAX_NODES-1)) {
+            NodeEntry &e = nodes[i];
+            if (e.id == nodeId) return &e;
+            if (e.id == 0) return 0;
+        }
+    }
+
+    // insert returns the entry for a node, creating it if necessary. If the table is full the
+    // node heard of least recently is evicted.
+    NodeEntry &insert(uint32_t nodeId) {
+        NodeEntry *e = find(nodeId);
+        if (e) return *e;
+        uint32_t now = millis();
+        if (numNodes >= NODE_CAP) {
+            int lru = 0;
+            for (int i=1; i<MAX_NODES; i++)
+                if (nodes[i].id != 0 && (nodes[lru].id == 0 || now-nodes[i].seen > now-nodes[lru].seen))
+                    lru = i;
+            EVLOG(EV_NODE_EVICT, nodes[lru].id, now-nodes[lru].seen, nodeId);
+            evictions++;
+            remove(lru);
+        }
+        int i = hash(nodeId);
+        while (nodes[i].id != 0) i = (i+1) & (MAX_NODES-1);
+        e = &nodes[i];
+        numNodes++;
+        memset(e, 0, sizeof(NodeEntry));
+        e->id = nodeId;
+        e->gwId = -1;
+        e->margin = -100;
+        e->at = now;
+        e->seen = now;
+        e->peerId = -1;
+        return *e;
+    }
+
+    // remove empties slot i and shifts the entries that follow it back towards their home slot
+    // so their probe sequences don't get cut
+    void remove(int i) {
+        for (int j=(i+1) & (MAX_NODES-1); nodes[j].id != 0; j=(j+1) & (MAX_NODES-1)) {
+            int h = hash(nodes[j].id);
+            // entry j stays put if its home slot lies cyclically in (i, j]
+            if (i <= j ? (i < h && h <= j) : (i < h || h <= j)) continue;
+            nodes[i] = nodes[j];
+            i = j;
+        }
+        nodes[i].id = 0;
+        numNodes--;
+    }
 
     NodeRegistry(const char *selfGwName) {
-        gateways[0] = selfGwName;
-        numGW = 1;
+        memset(gateways, 0, sizeof(gateways));
+        numGW = 0;
+        gwReplaced = 0;
+        ackCollisions = 0;
+        ackMissed = 0;
         entryTimeout = 5000;
+        memset(nodes, 0, sizeof(nodes));
+        numNodes = 0;
+        evictions = 0;
+        setSelf(selfGwName);
     }
     NodeRegistry() = delete;
 
+    // setSelf sets the name of this gateway, other gateways are retained. It takes the lock since
+    // it's called on MQTT connect while the radio task may be using gateways[0] in tieBreak.
     void setSelf(const char *selfGwName) {
-        gateways[0] = selfGwName;
-        numGW = 1;
+        std::lock_guard<std::mutex> lock(mtx);
+        setGW(0, selfGwName, hashName(selfGwName));
+        if (numGW < 1) numGW = 1;
+    }
+
+    // hashName returns the FNV-1a hash of a gateway name
+    static uint32_t hashName(const char *name) {
+        uint32_t h = 2166136261u;
+        while (*name) h = (h ^ (uint8_t)*name++) * 16777619u;
+        return h;
+    }
+
+    void setGW(int i, const char *gwName, uint32_t hash) {
+        GwEntry &g = gateways[i];
+        size_t n = strnlen(gwName, GW_NAME_LEN-1);
+        memcpy(g.name, gwName, n);
+        g.name[n] = 0;
+        g.hash = hash;
+        g.seen = millis();
     }
 
+    // lookupGW returns the gwId of a gateway, adding it to the table if necessary
     int lookupGW(const char *gwName) {
+        uint32_t h = hashName(gwName);
         for (int i=0; i<numGW; i++) {
-            if (strcmp(gwName, gateways[i]) == 0) return i;
+            GwEntry &g = gateways[i];
+            if (g.hash == h && strncmp(gwName, g.name, GW_NAME_LEN-1) == 0) {
+                g.seen = millis();
+                return i;
+            }
+        }
+        int i = numGW;
+        if (numGW < MAX_GW) {
+            numGW++;
+        } else {
+            // replace the gateway heard from least recently, never self
+            uint32_t now = millis();
+            i = 1;
+            for (int j=2; j<MAX_GW; j++)
+                if (now - gateways[j].seen > now - gateways[i].seen) i = j;
+            if (debug) printf("GW #%d: replacing %s\n", i, gateways[i].name);
+            gateways[i].gen++;
+            gwReplaced++;
         }
-        int i = numGW < MAX_GW ? numGW++ : 1;
-        char *copy = (char *)malloc(strlen(gwName)+1);
-        strcpy(copy, gwName);
-        gateways[i] = copy;
-        if (debug) printf("New GW #%d: %s\n", i, copy);
+        setGW(i, gwName, h);
+        if (debug) printf("New GW #%d: %s\n", i, gateways[i].name);
         return i;
     }
 };
@@ -82,7 +422,7 @@ public:
     NodeRegistryWorker() = delete;
     NodeRegistryWorker(const char *self, const char *gwTopic = "rfgw/reports",
             const char *ackTopic = "rfgw/acks")
-        : registry(NodeRegistry(self))
+        : registry(self)
         , gwTopic(gwTopic)
         , ackTopic(ackTopic)
         , selfGw(self)
@@ -91,15 +431,28 @@ public:
     const char *gwTopic;
     const char *ackTopic;
     const char *selfGw;
+    char gwTopicBin[48];                // gwTopic + "b", for binary summaries
+    GossipSummary summary;
+    uint32_t gossipTx = 0, gossipRx = 0; // gossip messages sent and received
+    // onPublished is called when another gateway reports having published a packet, see dedup.h
+    std::function<void(uint32_t node, uint16_t hash)> onPublished;
 
     // onMqttMessage handles gw/node reception announcements.
     void onMqttMessage(char* topic, char* payload, MqttProps properties,
         size_t len, size_t index, size_t total)
     {
+        MemScope mem(MEM_REG);
+        // Handle binary gw summaries
+        if (len == total && strcmp(topic, gwTopicBin) == 0) {
+            gossipRx++;
+            onSummary((const uint8_t *)payload, len, topic);
+            return;
+        }
         // Handle gw/node announcements
         if (len < 128 && len == total && strcmp(topic, gwTopic) == 0) {
+            gossipRx++;
             if (registry.debug) { payload[len] = 0; printf("%s: %s\n", topic, payload); }
-            DynamicJsonDocument json(256); // TODO: use JSON_OBJECT_SIZE, etc...
+            StaticJsonDocument<256> json;
             DeserializationError err = deserializeJson(json, payload, len);
             if (err) {
                 printf("Failed to deserialize %s message: %s\n", topic, err.c_str());
@@ -109,37 +462,101 @@ public:
             int margin = json["margin"];
             uint32_t node = json["node"];
             bool ack = json["ack"];
+            uint32_t pub = json["pub"];
             if (!gwName || node == 0) {
                 printf("Bad data in %s message gwName=%s margin=%d node=%x\n", topic, gwName, margin, node);
                 return;
             }
-            if (!ack) registry.addInfo(node, gwName, margin);
+            if (pub && onPublished && !isSelf(gwName)) onPublished(node, pub);
+            if (ack) registry.addAck(node, gwName);
+            else registry.addInfo(node, gwName, margin);
+        }
+    }
+
+    // onSummary decodes a binary summary in place, see GossipSummary
+    void onSummary(const uint8_t *p, size_t len, const char *topic) {
+        int nameLen = len >= 2 ? p[1] : 0;
+        int n = (int)len - 2 - nameLen;
+        if (len < 2 || p[0] != GOSSIP_VERSION || nameLen == 0 || nameLen >= GW_NAME_LEN ||
+                n < 0 || n % sizeof(GossipEntry) != 0) {
+            printf("Bad %s message, len=%d\n", topic, (int)len);
+            return;
+        }
+        char gwName[GW_NAME_LEN];
+        memcpy(gwName, p+2, nameLen);
+        gwName[nameLen] = 0;
+        n /= sizeof(GossipEntry);
+        if (registry.debug) printf("%s: %s with %d nodes\n", topic, gwName, n);
+        const GossipEntry *entries = (const GossipEntry *)(p+2+nameLen);
+        registry.addSummary(gwName, entries, n);
+        if (onPublished && !isSelf(gwName)) {
+            for (int i=0; i<n; i++) if (entries[i].hash) onPublished(entries[i].node, entries[i].hash);
         }
     }
 
+    bool isSelf(const char *gwName) { return strncmp(gwName, selfGw, GW_NAME_LEN-1) == 0; }
+
     void onMqttConnect(bool sessionPresent) {
+        MemScope mem(MEM_REG);
         registry.setSelf(selfGw);
         mqttClient.subscribe(gwTopic, 1);
-        printf("Subscribed to %s for NodeRegistry\n", gwTopic);
+        mqttClient.subscribe(gwTopicBin, 1);
+        printf("Subscribed to %s and %s for NodeRegistry\n", gwTopic, gwTopicBin);
     }
 
-    bool shouldAck(uint32_t nodeId) {
+    bool shouldAck(uint32_t nodeId, int snr, int mode) {
         if (nodeId == 0) return false; // never ACK another GW's packet
-        return registry.shouldAck(nodeId);
+        return registry.shouldAck(nodeId, snr, mode);
     }
 
-    void sendInfo(uint32_t nodeId, int margin, bool didAck) {
+    bool designated(uint32_t nodeId) { return registry.isBest(nodeId); }
+
+    // sendInfo informs the other gateways about a received packet, either right away in JSON or
+    // by adding it to the next binary summary. pubHash is the packet's dedupHash if this gateway
+    // published it, else 0.
+    void sendInfo(uint32_t nodeId, int margin, bool didAck, bool binary, uint16_t pubHash = 0) {
+        MemScope mem(MEM_REG);
+        if (binary) {
+            bool urgent = registry.materialChange(nodeId, margin);
+            if (!summary.add(nodeId, margin, didAck, pubHash, millis())) {
+                sendSummary();
+                summary.add(nodeId, margin, didAck, pubHash, millis());
+            }
+            if (urgent || summary.count == GOSSIP_MAX) sendSummary();
+            return;
+        }
         char payload[128];
-        snprintf(payload, 128, "{\"gw\":\"%s\",\"node\":%u,\"margin\":%d}", selfGw, nodeId, margin);
+        char pub[16] = "";
+        if (pubHash) snprintf(pub, sizeof(pub), ",\"pub\":%u", pubHash);
+        snprintf(payload, 128, "{\"gw\":\"%s\",\"node\":%u,\"margin\":%d%s}", selfGw, nodeId,
+                margin, pub);
         uint16_t packetId = mqttClient.publish(gwTopic, 1, false, payload);
+        gossipTx++;
         if (registry.debug) printf("Pub to %s -> %d: %s\n", gwTopic, packetId, payload);
         if (didAck) {
             snprintf(payload, 128, "{\"gw\":\"%s\",\"node\":%d,\"ack\":true}", selfGw, nodeId);
             mqttClient.publish(gwTopic, 1, false, payload);
+            gossipTx++;
         }
     }
 
+    void sendSummary() {
+        MemScope mem(MEM_REG);
+        uint8_t buf[GOSSIP_MSG_MAX];
+        int len = summary.encode(selfGw, buf, sizeof(buf), millis());
+        if (len == 0) return;
+        uint16_t packetId = mqttClient.publish(gwTopicBin, 1, false, (const char *)buf, len);
+        gossipTx++;
+        if (registry.debug) printf("Pub to %s -> %d: %d bytes\n", gwTopicBin, packetId, len);
+    }
+
+    // loop sends the pending binary summary once its oldest entry is intervalMs old
+    void loop(uint32_t intervalMs) {
+        if (summary.count > 0 && millis() - summary.first >= intervalMs) sendSummary();
+    }
+
     void setup() {
+        snprintf(gwTopicBin, sizeof(gwTopicBin), "%sb", gwTopic);
         mqttClient.onConnect(std::bind(&NodeRegistryWorker::onMqttConnect, this, _1));
         mqttClient.onMessage(std::bind(&NodeRegistryWorker::onMqttMessage, this,
                     _1, _2, _3, _4, _5, _6));
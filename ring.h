@@ -0,0 +1,51 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// SPSCRing is a lock-free single-producer/single-consumer ring buffer. It is used to hand
+// decoded packets from the radio task to the MQTT publisher running on the other core.
+// Exactly one task may call push() and exactly one task may call pop().
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+template <typename T, int SIZE>
+class SPSCRing {
+    static_assert((SIZE & (SIZE-1)) == 0, "SPSCRing size must be a power of 2");
+public:
+    // push appends an element, returns false and counts an overflow if the ring is full
+    bool push(const T &v) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t used = h - tail.load(std::memory_order_acquire);
+        if (used >= SIZE) {
+            overflows++;
+            return false;
+        }
+        buf[h & (SIZE-1)] = v;
+        head.store(h+1, std::memory_order_release);
+        if ((int)used+1 > highWater) highWater = used+1;
+        return true;
+    }
+
+    // pop removes the oldest element, returns false if the ring is empty
+    bool pop(T &v) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        v = buf[t & (SIZE-1)];
+        tail.store(t+1, std::memory_order_release);
+        return true;
+    }
+
+    int count() { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+    int size() { return SIZE; }
+
+    // stats, only updated by the producer
+    uint32_t overflows = 0;     // number of elements dropped because the ring was full
+    int highWater = 0;          // max number of elements in the ring at any point in time
+
+private:
+    T buf[SIZE];
+    std::atomic<uint32_t> head{0};  // next slot to write, only written by the producer
+    std::atomic<uint32_t> tail{0};  // next slot to read, only written by the consumer
+};
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+# ESP32 FSK Radio to MQTT gateway
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Reference decoder for the CBOR packet records the gateway publishes on <topic>/rxb when
+# rxFormat includes RX_FMT_CBOR, see encodeRxCbor in formats.h. to_json() converts a record to
+# the dict that the gateway publishes as JSON on <topic>/rx for the same packet. When batching is
+# enabled (rxBatchMs) a message is an indefinite-length array of such records.
+#
+# Usage: rxcbor.py <hex> ...   or   mosquitto_sub -t 'rfgw/+/rxb' -F %x | rxcbor.py
+
+import base64
+import datetime
+import json
+import sys
+
+KEYS = ["at", "gw", "hwid", "rssi", "snr", "fei", "type", "remote_margin", "remote_fei",
+        "payload", "data"]
+
+
+def decode_item(buf, i):
+    """Decode the CBOR item starting at buf[i], return (value, next index).
+    Only the subset produced by the gateway is supported: ints, byte and text strings, maps and
+    definite or indefinite-length arrays."""
+    major, info = buf[i] >> 5, buf[i] & 0x1f
+    i += 1
+    if major == 4 and info == 31:
+        arr = []
+        while buf[i] != 0xff:
+            x, i = decode_item(buf, i)
+            arr.append(x)
+        return arr, i+1
+    if info < 24:
+        v = info
+    elif info in (24, 25, 26, 27):
+        n = 1 << (info - 24)
+        v = int.from_bytes(buf[i:i+n], "big")
+        i += n
+    else:
+        raise ValueError("unsupported CBOR additional info %d" % info)
+    if major == 0:
+        return v, i
+    if major == 1:
+        return -1 - v, i
+    if major == 2:
+        return bytes(buf[i:i+v]), i+v
+    if major == 3:
+        return buf[i:i+v].decode("utf-8"), i+v
+    if major == 4:
+        arr = []
+        for _ in range(v):
+            x, i = decode_item(buf, i)
+            arr.append(x)
+        return arr, i
+    if major == 5:
+        m = {}
+        for _ in range(v):
+            k, i = decode_item(buf, i)
+            m[k], i = decode_item(buf, i)
+        return m, i
+    raise ValueError("unsupported CBOR major type %d" % major)
+
+
+def decode(buf):
+    """Decode a <topic>/rxb message into a list of dicts keyed by field name."""
+    m, i = decode_item(bytes(buf), 0)
+    if i != len(buf):
+        raise ValueError("%d trailing bytes" % (len(buf) - i))
+    recs = m if isinstance(m, list) else [m]
+    return [{KEYS[k]: v for k, v in r.items()} for r in recs]
+
+
+def to_json(rec):
+    """Convert a decoded record to the equivalent <topic>/rx JSON dict."""
+    at = datetime.datetime.fromtimestamp(rec["at"] / 1000, datetime.timezone.utc)
+    j = dict(rec)
+    j["at"] = at.strftime("%Y-%m-%dT%H:%M:%S.") + "%03dZ" % (rec["at"] % 1000)
+    j["hwid"] = "%x" % rec["hwid"]
+    j["payload"] = base64.b64encode(rec["payload"]).decode("ascii")
+    return j
+
+
+if __name__ == "__main__":
+    lines = sys.argv[1:] or sys.stdin
+    for line in lines:
+        line = line.strip()
+        if line:
+            for rec in decode(bytes.fromhex(line)):
+                print(json.dumps(to_json(rec)))
@@ -0,0 +1,49 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Packet timing: when compiled with PKT_TIMING=1 each jlPacket carries esp_timer timestamps of
+// the stages of its life and, when the broker acknowledges the packet, the time spent in each
+// stage is recorded in a LogHistogram. The percentiles are published in the stats message.
+// With PKT_TIMING=0 (the default) none of this is compiled in.
+
+#pragma once
+
+#ifndef PKT_TIMING
+#define PKT_TIMING 0
+#endif
+
+#if PKT_TIMING
+
+#include "histogram.h"
+
+// timestamps kept in jlPacket::ts, in microseconds
+enum {
+    PKT_RX,         // end of the packet, per radio.rxAt
+    PKT_READ,       // read from the radio by the radio task
+    PKT_ACK,        // ACK decided and sent
+    PKT_DECODE,     // decoded into a jlPacket
+    PKT_POP,        // picked up by loop()
+    PKT_PUB1,       // first publish
+    PKT_PUB,        // most recent publish
+    PKT_STAGES
+};
+
+struct PktTiming {
+    LogHistogram radio;     // RX -> READ: radio polling
+    LogHistogram ack;       // READ -> ACK
+    LogHistogram decode;    // ACK -> DECODE
+    LogHistogram ring;      // DECODE -> POP: hand-off to loop()
+    LogHistogram publish;   // POP -> PUB1: encoding, batching and queueing while disconnected
+    LogHistogram puback;    // PUB -> PUBACK
+    LogHistogram rexmit;    // PUB -> retransmission
+    LogHistogram total;     // RX -> PUBACK
+};
+extern PktTiming pktTiming;
+
+#define PKT_STAMP(pkt, stage) ((pkt)->ts[stage] = esp_timer_get_time())
+
+#else
+
+#define PKT_STAMP(pkt, stage) do { } while (0)
+
+#endif
@@ -0,0 +1,53 @@
+// ESP32 FSK Radio to MQTT gateway
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// JeeLabs varints: a value is zigzag encoded (0, -1, 1, -2, ... become 0, 1, 2, 3, ...) and sent
+// in 7-bit groups, most significant first, with the top bit set in the last byte. A payload is
+// a sequence of varints.
+// varintCount validates a payload and counts its values four bytes at a time, VarintReader then
+// decodes the values one by one so the encoders can stream them into their output without an
+// intermediate array and without a limit on their number. Values longer than 5 bytes wrap
+// around, as in the SX1276fsk library's decodeVarints.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// varintCount returns the number of values in the payload, or -1 if the last one is incomplete
+static inline int varintCount(const uint8_t *buf, int len) {
+    if (len <= 0) return 0;
+    if (!(buf[len-1] & 0x80)) return -1;
+    int n = 0, i = 0;
+    for (; i+4 <= len; i += 4) {
+        uint32_t w;
+        memcpy(&w, buf+i, 4);
+        // move each byte's stop bit to the bottom and add the four bytes up in the top one
+        n += (((w & 0x80808080u) >> 7) * 0x01010101u) >> 24;
+    }
+    for (; i < len; i++) n += buf[i] >> 7;
+    return n;
+}
+
+// VarintReader decodes the values of a payload that varintCount found to be complete
+class VarintReader {
+public:
+    VarintReader(const uint8_t *buf, int len) : p(buf), end(buf+len) { }
+
+    // next decodes the next value, it returns false at the end of the payload
+    bool next(int32_t &v) {
+        if (p >= end) return false;
+        uint32_t z = 0;
+        uint8_t b;
+        // no bounds check needed: the payload ends with a stop bit
+        do {
+            b = *p++;
+            z = (z << 7) | (b & 0x7f);
+        } while (!(b & 0x80));
+        v = (int32_t)((z >> 1) ^ -(z & 1));
+        return true;
+    }
+
+private:
+    const uint8_t *p, *end;
+};